@@ -0,0 +1,295 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <janet.h>
+#include "hermes.h"
+#include "z.h"
+
+/* Build output is read by a thread while the builder runs, so a chatty
+ * build never blocks on a full pipe or grows our memory. Everything goes
+ * to a gzip log, the terminal only gets a limited number of lines per
+ * second, and the last few KiB are kept to show when the build fails.
+ */
+
+#define LOG_READ_LEN 65536
+#define LOG_TAIL_LEN 8192
+
+typedef struct {
+    int in_fd;
+    int out_fd;
+    int echo_fd;
+    int echo_lines_per_sec;
+    int log_failed;
+    zs_stream z;
+    uint8_t zbuf[LOG_READ_LEN];
+
+    /* Tail of the output as a ring buffer. */
+    char tail[LOG_TAIL_LEN];
+    size_t tail_end;
+    size_t tail_len;
+
+    /* Terminal rate limit, lines echoed in the current second. */
+    time_t window;
+    int window_lines;
+    int echoing;
+    int at_line_start;
+    uint64_t dropped_lines;
+} BuildLogState;
+
+typedef struct {
+    BuildLogState *s;
+    pthread_t thread;
+    int running;
+} BuildLog;
+
+static int write_all(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n) {
+        ssize_t rc = write(fd, p, n);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+static void log_deflate(BuildLogState *s, const void *buf, size_t n, int flush) {
+    if (s->out_fd < 0 || s->log_failed)
+        return;
+    s->z.next_in = (void *)buf;
+    s->z.avail_in = n;
+    do {
+        s->z.next_out = s->zbuf;
+        s->z.avail_out = sizeof(s->zbuf);
+        if (zs_deflate(&s->z, flush) == Z_STREAM_ERROR) {
+            s->log_failed = 1;
+            return;
+        }
+        if (write_all(s->out_fd, s->zbuf, sizeof(s->zbuf) - s->z.avail_out) != 0) {
+            s->log_failed = 1;
+            return;
+        }
+    } while (s->z.avail_out == 0);
+}
+
+static void log_tail(BuildLogState *s, const char *buf, size_t n) {
+    if (n > LOG_TAIL_LEN) {
+        buf += n - LOG_TAIL_LEN;
+        n = LOG_TAIL_LEN;
+    }
+    while (n) {
+        size_t chunk = LOG_TAIL_LEN - s->tail_end;
+        if (chunk > n)
+            chunk = n;
+        memcpy(s->tail + s->tail_end, buf, chunk);
+        s->tail_end = (s->tail_end + chunk) % LOG_TAIL_LEN;
+        s->tail_len = s->tail_len + chunk > LOG_TAIL_LEN ? LOG_TAIL_LEN : s->tail_len + chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+}
+
+static void log_echo(BuildLogState *s, const char *buf, size_t n) {
+    while (n) {
+        if (s->at_line_start) {
+            time_t now = time(NULL);
+            if (now != s->window) {
+                if (s->dropped_lines) {
+                    char msg[64];
+                    int len = snprintf(msg, sizeof(msg), "... %llu lines not shown ...\n",
+                                       (unsigned long long)s->dropped_lines);
+                    write_all(s->echo_fd, msg, len);
+                    s->dropped_lines = 0;
+                }
+                s->window = now;
+                s->window_lines = 0;
+            }
+            s->echoing = s->window_lines++ < s->echo_lines_per_sec;
+            if (!s->echoing)
+                s->dropped_lines++;
+            s->at_line_start = 0;
+        }
+        const char *nl = memchr(buf, '\n', n);
+        size_t len = nl ? (size_t)(nl - buf) + 1 : n;
+        if (s->echoing)
+            write_all(s->echo_fd, buf, len);
+        if (nl)
+            s->at_line_start = 1;
+        buf += len;
+        n -= len;
+    }
+}
+
+static void *build_log_thread(void *p) {
+    BuildLogState *s = p;
+    char buf[LOG_READ_LEN];
+    while (1) {
+        ssize_t n = read(s->in_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        log_deflate(s, buf, n, Z_NO_FLUSH);
+        log_tail(s, buf, n);
+        if (s->echo_fd >= 0)
+            log_echo(s, buf, n);
+    }
+    if (s->echo_fd >= 0 && s->dropped_lines) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "... %llu lines not shown ...\n",
+                           (unsigned long long)s->dropped_lines);
+        write_all(s->echo_fd, msg, len);
+    }
+    log_deflate(s, NULL, 0, Z_FINISH);
+    return NULL;
+}
+
+static void build_log_join(BuildLog *l) {
+    if (!l->running)
+        return;
+    pthread_join(l->thread, NULL);
+    l->running = 0;
+    close(l->s->in_fd);
+    if (l->s->out_fd >= 0) {
+        zs_deflateEnd(&l->s->z);
+        if (close(l->s->out_fd) != 0)
+            l->s->log_failed = 1;
+    }
+}
+
+static int build_log_gc(void *p, size_t len) {
+    (void) len;
+    BuildLog *l = p;
+    /* The builder is gone by now, so this only waits for the last read. */
+    build_log_join(l);
+    free(l->s);
+    l->s = NULL;
+    return 0;
+}
+
+static int build_log_get(void *p, Janet key, Janet *out);
+
+const JanetAbstractType hermes_build_log_type = {
+    "_hermes/build-log",
+    build_log_gc,
+    NULL,
+    build_log_get,
+    JANET_ATEND_GET
+};
+
+/* Waits for the output to end, returns [tail lines-not-shown]. */
+static Janet build_log_wait(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    BuildLog *l = janet_getabstract(argv, 0, &hermes_build_log_type);
+    if (!l->s)
+        janet_panicf("build log already closed");
+    build_log_join(l);
+    BuildLogState *s = l->s;
+    if (s->log_failed)
+        fprintf(stderr, "warning: unable to write build log\n");
+
+    JanetBuffer *tail = janet_buffer(s->tail_len);
+    size_t start = (s->tail_end + LOG_TAIL_LEN - s->tail_len) % LOG_TAIL_LEN;
+    for (size_t i = 0; i < s->tail_len; i++)
+        janet_buffer_push_u8(tail, s->tail[(start + i) % LOG_TAIL_LEN]);
+    /* Drop the partial first line once the ring has wrapped. */
+    int32_t from = 0;
+    if (s->tail_len == LOG_TAIL_LEN) {
+        uint8_t *nl = memchr(tail->data, '\n', tail->count);
+        if (nl)
+            from = nl - tail->data + 1;
+    }
+    Janet result[2] = {
+        janet_stringv(tail->data + from, tail->count - from),
+        janet_wrap_number(s->dropped_lines),
+    };
+    return janet_wrap_tuple(janet_tuple_n(result, 2));
+}
+
+static JanetMethod build_log_methods[] = {
+    {"wait", build_log_wait},
+    {NULL, NULL}
+};
+
+static int build_log_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), build_log_methods, out);
+}
+
+/* (build-log in-file log-path echo-lines-per-sec)
+ *
+ * Start reading in-file, the read end of a pipe, into a gzip file at
+ * log-path. log-path may be nil for no log, and echo-lines-per-sec nil
+ * to not echo to stderr at all.
+ */
+Janet build_log(int argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    /* Every argument is checked before anything is opened. */
+    FILE *in = janet_getfile(argv, 0, NULL);
+    const char *path = NULL;
+    if (!janet_checktype(argv[1], JANET_NIL))
+        path = (const char *)janet_getstring(argv, 1);
+    int echo = !janet_checktype(argv[2], JANET_NIL);
+    int32_t echo_lines_per_sec = echo ? janet_getinteger(argv, 2) : 0;
+
+    BuildLog *l = janet_abstract(&hermes_build_log_type, sizeof(BuildLog));
+    l->running = 0;
+    l->s = calloc(1, sizeof(BuildLogState));
+    if (!l->s)
+        janet_panicf("out of memory");
+    BuildLogState *s = l->s;
+    s->out_fd = -1;
+    s->echo_fd = -1;
+    s->at_line_start = 1;
+
+    s->in_fd = fcntl(fileno(in), F_DUPFD_CLOEXEC, 0);
+    if (s->in_fd < 0)
+        janet_panicf("unable to dup build output pipe - %s", strerror(errno));
+
+    if (path) {
+        s->out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        /* Readable by whoever asked for the build, whatever our umask. */
+        if (s->out_fd < 0 || fchmod(s->out_fd, 0644) != 0) {
+            int err = errno;
+            close(s->in_fd);
+            if (s->out_fd >= 0)
+                close(s->out_fd);
+            janet_panicf("unable to open %s - %s", path, strerror(err));
+        }
+        /* Level 1, the log must keep up with the build. */
+        if (zs_deflateInit2(&s->z, 1, Z_DEFLATED, MAX_WBITS | 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            close(s->in_fd);
+            close(s->out_fd);
+            janet_panicf("unable to initialize build log compression");
+        }
+    }
+
+    if (echo) {
+        s->echo_fd = STDERR_FILENO;
+        s->echo_lines_per_sec = echo_lines_per_sec;
+    }
+
+    if (pthread_create(&l->thread, NULL, build_log_thread, s) != 0) {
+        close(s->in_fd);
+        if (s->out_fd >= 0) {
+            zs_deflateEnd(&s->z);
+            close(s->out_fd);
+        }
+        janet_panicf("unable to start build log thread");
+    }
+    l->running = 1;
+    return janet_wrap_abstract(l);
+}
@@ -105,3 +105,344 @@ Janet pkg_dependencies(int argc, Janet *argv) {
     pkg_dependencies2(deps, seen, p->weak_refs);
     return janet_wrap_table(deps);
 }
+
+/* The dependencies of a whole package DAG in one walk.
+ *
+ * Packages often share the values their builders reach, helper
+ * functions, tables of packages and so on, and walking them again
+ * for every package is most of the work. Instead every value is walked
+ * once, and the set of packages reachable from it is kept. Values can
+ * refer to each other in cycles, so sets are found per strongly
+ * connected component, Tarjan's algorithm. */
+
+typedef struct {
+    int32_t count;
+    Janet pkgs[];
+} DepSet;
+
+typedef struct {
+    int32_t index;
+    int32_t lowlink;
+    int onstack;
+    /* Final once the component is done. Until then a node collects
+     * what it reaches in only, a set it can share with a child,
+     * and acc, which may hold duplicates. */
+    DepSet *only;
+    Janet *acc;
+} DepNode;
+
+typedef struct {
+    JanetTable *ids; /* value -> index into nodes */
+    DepNode *nodes;
+    int32_t *stack;
+    DepSet **sets;
+    JanetTable *stamps; /* pkg -> stamp it was last added to a set with */
+    int32_t stamp;
+} DepState;
+
+static void node_add_pkg(DepState *s, int32_t n, Janet pkg) {
+    DepNode *node = &s->nodes[n];
+    if (node->only) {
+        for (int32_t i = 0; i < node->only->count; i++) {
+            scratch_v_push(node->acc, node->only->pkgs[i]);
+        }
+        node->only = NULL;
+    }
+    scratch_v_push(node->acc, pkg);
+}
+
+static void node_add_set(DepState *s, int32_t n, DepSet *set) {
+    DepNode *node = &s->nodes[n];
+    if (!set || set == node->only) {
+        return;
+    }
+    if (!node->only && !scratch_v_count(node->acc)) {
+        node->only = set;
+        return;
+    }
+    for (int32_t i = 0; i < set->count; i++) {
+        node_add_pkg(s, n, set->pkgs[i]);
+    }
+}
+
+/* A new set of the distinct packages in pkgs, NULL if there are none. */
+static DepSet *make_dep_set(DepState *s, Janet *pkgs) {
+    int32_t n = scratch_v_count(pkgs);
+    if (!n) {
+        return NULL;
+    }
+    DepSet *set = janet_smalloc(sizeof(DepSet) + n * sizeof(Janet));
+    set->count = 0;
+    s->stamp++;
+    for (int32_t i = 0; i < n; i++) {
+        Janet stamp = janet_table_get(s->stamps, pkgs[i]);
+        if (janet_checkint(stamp) && janet_unwrap_integer(stamp) == s->stamp) {
+            continue;
+        }
+        janet_table_put(s->stamps, pkgs[i], janet_wrap_integer(s->stamp));
+        set->pkgs[set->count++] = pkgs[i];
+    }
+    scratch_v_push(s->sets, set);
+    return set;
+}
+
+static int32_t dep_visit(DepState *s, Janet v);
+
+/* Follow an edge from node n to v. */
+static void dep_edge(DepState *s, int32_t n, Janet v) {
+    switch (janet_type(v)) {
+    case JANET_NIL:
+    case JANET_BOOLEAN:
+    case JANET_NUMBER:
+    case JANET_BUFFER:
+    case JANET_STRING:
+    case JANET_KEYWORD:
+    case JANET_SYMBOL:
+    case JANET_CFUNCTION:
+        return;
+    default:
+        break;
+    }
+    if (janet_checkabstract(v, &pkg_type)) {
+        node_add_pkg(s, n, v);
+        return;
+    }
+    if (janet_checkabstract(v, &janet_file_type)) {
+        return;
+    }
+
+    int32_t w = dep_visit(s, v);
+    if (s->nodes[w].onstack) {
+        /* w is in the same component as n */
+        if (s->nodes[w].lowlink < s->nodes[n].lowlink) {
+            s->nodes[n].lowlink = s->nodes[w].lowlink;
+        }
+    } else if (s->nodes[w].lowlink == -1) {
+        /* w is in a finished component */
+        node_add_set(s, n, s->nodes[w].only);
+    }
+}
+
+static void dep_edge_funcdef(DepState *s, int32_t n, JanetFuncDef *def) {
+    for (int32_t i = 0; i < def->constants_length; i++) {
+        dep_edge(s, n, def->constants[i]);
+    }
+    for (int32_t i = 0; i < def->defs_length; i++) {
+        dep_edge_funcdef(s, n, def->defs[i]);
+    }
+}
+
+/* Returns the node of v, walking it first if it is new. */
+static int32_t dep_visit(DepState *s, Janet v) {
+    Janet id = janet_table_get(s->ids, v);
+    if (janet_checkint(id)) {
+        return janet_unwrap_integer(id);
+    }
+
+    int32_t n = scratch_v_count(s->nodes);
+    DepNode node;
+    node.index = n;
+    node.lowlink = n;
+    node.onstack = 1;
+    node.only = NULL;
+    node.acc = NULL;
+    scratch_v_push(s->nodes, node);
+    scratch_v_push(s->stack, n);
+    janet_table_put(s->ids, v, janet_wrap_integer(n));
+
+    switch (janet_type(v)) {
+    case JANET_TABLE:
+    case JANET_STRUCT: {
+        const JanetKV *kvs = NULL, *kv = NULL;
+        int32_t len, cap;
+        janet_dictionary_view(v, &kvs, &len, &cap);
+        while ((kv = janet_dictionary_next(kvs, cap, kv))) {
+            dep_edge(s, n, kv->key);
+            dep_edge(s, n, kv->value);
+        }
+        break;
+    }
+    case JANET_ARRAY:
+    case JANET_TUPLE: {
+        int32_t len;
+        const Janet *data;
+        janet_indexed_view(v, &data, &len);
+        for (int32_t i = 0; i < len; i++) {
+            dep_edge(s, n, data[i]);
+        }
+        break;
+    }
+    case JANET_FUNCTION: {
+        JanetFunction *func = janet_unwrap_function(v);
+        for (int32_t i = 0; i < func->def->environments_length; ++i) {
+            JanetFuncEnv *env = func->envs[i];
+            if (env->offset) {
+                janet_panic(
+                    "cannot extract dependencies from closure referencing current stack frame");
+            }
+            for (int32_t j = 0; j < env->length; j++) {
+                dep_edge(s, n, env->as.values[j]);
+            }
+        }
+        dep_edge_funcdef(s, n, func->def);
+        break;
+    }
+    case JANET_ABSTRACT:
+        if (janet_checkabstract(v, &janet_peg_type)) {
+            JanetPeg *peg = janet_unwrap_abstract(v);
+            for (size_t i = 0; i < peg->num_constants; i++) {
+                dep_edge(s, n, peg->constants[i]);
+            }
+            break;
+        }
+        /* fallthrough */
+    default:
+        janet_panicf("cannot extract package dependencies from %v", v);
+    }
+
+    if (s->nodes[n].lowlink == s->nodes[n].index) {
+        /* n is the root of a component, gather what all of it reaches. */
+        int32_t top = scratch_v_count(s->stack);
+        int32_t first = top;
+        do {
+            first--;
+        } while (s->stack[first] != n);
+        DepSet *set;
+        if (top - first == 1 && !scratch_v_count(s->nodes[n].acc)) {
+            set = s->nodes[n].only;
+        } else {
+            Janet *all = NULL;
+            for (int32_t i = first; i < top; i++) {
+                DepNode *m = &s->nodes[s->stack[i]];
+                if (m->only) {
+                    for (int32_t j = 0; j < m->only->count; j++) {
+                        scratch_v_push(all, m->only->pkgs[j]);
+                    }
+                }
+                for (int32_t j = 0; j < scratch_v_count(m->acc); j++) {
+                    scratch_v_push(all, m->acc[j]);
+                }
+            }
+            set = make_dep_set(s, all);
+            scratch_v_free(all);
+        }
+        for (int32_t i = first; i < top; i++) {
+            DepNode *m = &s->nodes[s->stack[i]];
+            scratch_v_free(m->acc);
+            m->acc = NULL;
+            m->only = set;
+            m->onstack = 0;
+            m->lowlink = -1;
+        }
+        scratch_v__cnt(s->stack) = first;
+    }
+
+    return n;
+}
+
+/* The distinct packages the builder and refs of pkg reach. */
+static DepSet *pkg_direct_deps(DepState *s, Pkg *pkg) {
+    Janet fields[4] = {pkg->builder, pkg->forced_refs, pkg->extra_refs, pkg->weak_refs};
+    Janet *all = NULL;
+    for (int i = 0; i < 4; i++) {
+        Janet v = fields[i];
+        if (janet_checkabstract(v, &pkg_type)) {
+            scratch_v_push(all, v);
+            continue;
+        }
+        switch (janet_type(v)) {
+        case JANET_NIL:
+        case JANET_BOOLEAN:
+        case JANET_NUMBER:
+        case JANET_BUFFER:
+        case JANET_STRING:
+        case JANET_KEYWORD:
+        case JANET_SYMBOL:
+        case JANET_CFUNCTION:
+            continue;
+        default:
+            break;
+        }
+        if (janet_checkabstract(v, &janet_file_type)) {
+            continue;
+        }
+        DepSet *set = s->nodes[dep_visit(s, v)].only;
+        if (set) {
+            for (int32_t j = 0; j < set->count; j++) {
+                scratch_v_push(all, set->pkgs[j]);
+            }
+        }
+    }
+    DepSet *set = make_dep_set(s, all);
+    scratch_v_free(all);
+    return set;
+}
+
+/* :order is a depth first post-order, dependencies before dependents.
+ * Direct dependencies are listed in the order the walk of a package's
+ * builder and refs first reaches them, which is not the hash table key
+ * order pkg-dependencies gave, so sibling packages can come out in a
+ * different order than they used to. */
+static void build_dep_info(DepState *s, Janet v, JanetTable *deps, JanetArray *order, JanetTable *all_pkgs) {
+    if (!janet_checktype(janet_table_get(deps, v), JANET_NIL)) {
+        return;
+    }
+    Pkg *pkg = janet_unwrap_abstract(v);
+    double seq = janet_unwrap_number(pkg->sequence_number);
+    DepSet *set = pkg_direct_deps(s, pkg);
+    int32_t n = set ? set->count : 0;
+    JanetArray *filtered = janet_array(0);
+    for (int32_t i = 0; i < n; i++) {
+        Pkg *dep = janet_unwrap_abstract(set->pkgs[i]);
+        janet_table_put(all_pkgs, set->pkgs[i], janet_wrap_true());
+        /* Only packages created before this one, anything else is a cycle. */
+        if (janet_unwrap_number(dep->sequence_number) < seq) {
+            janet_array_push(filtered, set->pkgs[i]);
+        }
+    }
+    janet_table_put(deps, v, janet_wrap_array(filtered));
+    for (int32_t i = 0; i < filtered->count; i++) {
+        build_dep_info(s, filtered->data[i], deps, order, all_pkgs);
+    }
+    janet_array_push(order, v);
+}
+
+Janet pkg_build_dep_info(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    janet_getabstract(argv, 0, &pkg_type);
+
+    DepState s;
+    s.ids = janet_table(0);
+    s.nodes = NULL;
+    s.stack = NULL;
+    s.sets = NULL;
+    s.stamps = janet_table(0);
+    s.stamp = 0;
+
+    JanetTable *deps = janet_table(0);
+    JanetArray *order = janet_array(0);
+    JanetTable *all_pkgs = janet_table(0);
+    janet_table_put(all_pkgs, argv[0], janet_wrap_true());
+
+    build_dep_info(&s, argv[0], deps, order, all_pkgs);
+
+    for (int32_t i = 0; i < scratch_v_count(s.sets); i++) {
+        janet_sfree(s.sets[i]);
+    }
+    scratch_v_free(s.sets);
+    scratch_v_free(s.stack);
+    scratch_v_free(s.nodes);
+
+    JanetArray *all = janet_array(all_pkgs->count);
+    for (int32_t i = 0; i < all_pkgs->capacity; i++) {
+        if (!janet_checktype(all_pkgs->data[i].key, JANET_NIL)) {
+            janet_array_push(all, all_pkgs->data[i].key);
+        }
+    }
+
+    JanetKV *info = janet_struct_begin(3);
+    janet_struct_put(info, janet_ckeywordv("deps"), janet_wrap_table(deps));
+    janet_struct_put(info, janet_ckeywordv("order"), janet_wrap_array(order));
+    janet_struct_put(info, janet_ckeywordv("all-pkgs"), janet_wrap_array(all));
+    return janet_wrap_struct(janet_struct_end(info));
+}
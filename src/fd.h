@@ -5,7 +5,7 @@
 #include <stdint.h> /* [u]int*_t */
 #include <stdlib.h> /* size_t */
 #include <sys/types.h> /* off_t, ssize_t */
-#include <fcntl.h> /* open */
+#include <fcntl.h> /* open, openat */
 #include <unistd.h> /* close, ftruncate, lseek */
 #include <errno.h> /* EINTR, errno */
 #include <limits.h> /* SSIZE_MAX */
@@ -26,7 +26,7 @@ struct fd {
     int fd;
 };
 
-static int_fast8_t fd_create(struct fd *ctx, const char *path, uint32_t flags, mode_t mode) {
+static inline int_fast8_t fd_create(struct fd *ctx, const char *path, uint32_t flags, mode_t mode) {
     assert(ctx != NULL && ctx->par == 0);
 
     ctx->fd = open(path, flags, mode);
@@ -38,14 +38,27 @@ static int_fast8_t fd_create(struct fd *ctx, const char *path, uint32_t flags, m
     return 0;
 }
 
-static void fd_destroy(struct fd *ctx) {
+/* Like fd_create, path is relative to the directory dirfd. */
+static inline int_fast8_t fd_createat(struct fd *ctx, int dirfd, const char *path, uint32_t flags, mode_t mode) {
+    assert(ctx != NULL && ctx->par == 0);
+
+    ctx->fd = openat(dirfd, path, flags, mode);
+    if (ctx->fd < 0) {
+        return -1;
+    }
+
+    ctx->par = 1;
+    return 0;
+}
+
+static inline void fd_destroy(struct fd *ctx) {
     assert(ctx != NULL && ctx->par != 0);
 
     close(ctx->fd);
     ctx->par = 0;
 }
 
-static int_fast8_t fd_stat(const struct fd *ctx, struct stat *stat) {
+static inline int_fast8_t fd_stat(const struct fd *ctx, struct stat *stat) {
     return fstat(ctx->fd, stat);
 }
 
@@ -53,7 +66,7 @@ static int_fast8_t fd_stat(const struct fd *ctx, struct stat *stat) {
  * return lseek(ctx->fd, off, flags);
  */
 
-static int_fast8_t fd_truncate(const struct fd *ctx, size_t len) {
+static inline int_fast8_t fd_truncate(const struct fd *ctx, size_t len) {
     /* OFF_MAX does not exist
      * so we cross our figers...
      */
@@ -61,19 +74,19 @@ static int_fast8_t fd_truncate(const struct fd *ctx, size_t len) {
 }
 
 /* TODO(iemaghni): futimens + struct timespec */
-static int_fast8_t fd_time(const struct fd *ctx, const struct timespec ts[2]) {
+static inline int_fast8_t fd_time(const struct fd *ctx, const struct timespec ts[2]) {
     return futimens(ctx->fd, ts);
 }
 
 
 /* implements read interface */
-static ssize_t fd_read(void *_ctx, uint8_t *buf, size_t len) {
+static inline ssize_t fd_read(void *_ctx, uint8_t *buf, size_t len) {
     const struct fd *ctx = _ctx;
 	return read(ctx->fd, buf, len);
 }
 
 /* implements write interface */
-static ssize_t fd_write(void *_ctx, const uint8_t *buf, size_t len) {
+static inline ssize_t fd_write(void *_ctx, const uint8_t *buf, size_t len) {
     ssize_t len2;
     const struct fd *ctx = _ctx;
 
@@ -190,3 +190,65 @@ Janet sha256_file_hash(int argc, Janet *argv) {
     base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
     return janet_stringv(hexbuf, sizeof(hexbuf));
 }
+
+/* Incremental sha256, for data that is only seen once as a stream. */
+
+typedef struct {
+    Sha256ctx ctx;
+    int finished;
+} StreamHasher;
+
+static int sha256_hasher_get(void *p, Janet key, Janet *out);
+
+const JanetAbstractType hermes_sha256_hasher_type = {
+    "_hermes/sha256-hasher",
+    NULL,
+    NULL,
+    sha256_hasher_get,
+    JANET_ATEND_GET
+};
+
+static Janet sha256_hasher_update(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    StreamHasher *h = janet_getabstract(argv, 0, &hermes_sha256_hasher_type);
+    JanetByteView bytes = janet_getbytes(argv, 1);
+    if (h->finished)
+        janet_panicf("hasher already finished");
+    sha256_update(&h->ctx, (uint8_t*)bytes.bytes, bytes.len);
+    return argv[0];
+}
+
+static Janet sha256_hasher_final(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    StreamHasher *h = janet_getabstract(argv, 0, &hermes_sha256_hasher_type);
+    if (h->finished)
+        janet_panicf("hasher already finished");
+    h->finished = 1;
+    uint8_t buf[32];
+    uint8_t hexbuf[sizeof(buf)*2];
+    sha256_finish(&h->ctx, buf);
+    base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
+    return janet_stringv(hexbuf, sizeof(hexbuf));
+}
+
+static JanetMethod sha256_hasher_methods[] = {
+    {"update", sha256_hasher_update},
+    {"final", sha256_hasher_final},
+    {NULL, NULL}
+};
+
+static int sha256_hasher_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), sha256_hasher_methods, out);
+}
+
+Janet sha256_hasher(int argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    StreamHasher *h = janet_abstract(&hermes_sha256_hasher_type, sizeof(StreamHasher));
+    sha256_init(&h->ctx);
+    h->finished = 0;
+    return janet_wrap_abstract(h);
+}
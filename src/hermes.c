@@ -183,9 +183,16 @@ static const JanetReg cfuns[] = {
     {"pkg-freeze", pkg_freeze, NULL},
     {"sha256-dir-hash", sha256_dir_hash, NULL},
     {"sha256-file-hash", sha256_file_hash, NULL},
+    {"sha256-hasher", sha256_hasher, NULL},
+    {"http-get", http_get, NULL},
+    {"http-probe", http_probe, NULL},
+    {"http-get-ranges", http_get_ranges, NULL},
+    {"build-log", build_log, NULL},
     {"pkg-dependencies", pkg_dependencies, NULL},
+    {"pkg-build-dep-info", pkg_build_dep_info, NULL},
     {"storify", storify, NULL},
     {"primitive-unpack2", primitive_unpack2, NULL},
+    {"primitive-unpack2-all", primitive_unpack2_all, NULL},
     {"hash-scan", hash_scan, NULL},
     {"getgrnam", jgetgrnam, NULL},
     {"getpwnam", jgetpwnam, NULL},
@@ -200,16 +207,24 @@ static const JanetReg cfuns[] = {
     {"setegid", jsetegid, NULL},
     {"chown", jchown, NULL},
     {"exit", jexit, NULL},
+    {"fork", jfork, NULL},
+    {"exec", jexec, NULL},
+    {"wait4", jwait4, NULL},
+    {"current-rss", jcurrent_rss, NULL},
     {"chroot", jchroot, NULL},
     {"getgroups", jgetgroups, NULL},
     {"cleargroups", jcleargroups, NULL},
     {"unix-listen", unix_listen, NULL},
     {"unix-connect", unix_connect, NULL},
     {"nuke-path", nuke_path, NULL},
+    {"mkdtemp", jmkdtemp, NULL},
     {"mount", jmount, NULL},
     {"sync", jsync, NULL},
+    {"syncfs", jsyncfs, NULL},
     {"fd-set-cloexec", jfd_set_cloexec, NULL},
     {"fd-close", jfd_close, NULL},
+    {"fd-dup2", jfd_dup2, NULL},
+    {"close-fds-except", jclose_fds_except, NULL},
     {NULL, NULL, NULL}
 };
 
@@ -1,15 +1,18 @@
 
 #define HASH_SZ 20
+#define HASH_STAGE_SZ 8192
 #include "sha1.h"
 
 /* types */
 
 typedef struct {
     Sha1ctx sha1_ctx;
+    uint8_t stage[HASH_STAGE_SZ]; /* hashed bytes not yet given to sha1 */
+    int32_t staged;
     JanetTable seen;
     JanetTable *rreg;
-    JanetFuncEnv **seen_envs;
-    JanetFuncDef **seen_defs;
+    JanetTable seen_envs; /* JanetFuncEnv pointer -> back reference */
+    JanetTable seen_defs; /* JanetFuncDef pointer -> back reference */
     int32_t nextid;
 } HashState;
 
@@ -49,6 +52,17 @@ Janet pkg_freeze(int32_t argc, Janet *argv);
 
 Janet sha256_dir_hash(int argc, Janet *argv);
 Janet sha256_file_hash(int argc, Janet *argv);
+Janet sha256_hasher(int argc, Janet *argv);
+
+/* http.c */
+
+Janet http_get(int argc, Janet *argv);
+Janet http_probe(int argc, Janet *argv);
+Janet http_get_ranges(int argc, Janet *argv);
+
+/* buildlog.c */
+
+Janet build_log(int argc, Janet *argv);
 
 /* hashscan.c */
 
@@ -61,6 +75,7 @@ Janet storify(int32_t argc, Janet *argv);
 /* deps.c */
 
 Janet pkg_dependencies(int argc, Janet *argv);
+Janet pkg_build_dep_info(int argc, Janet *argv);
 
 /* base16.c */
 
@@ -69,6 +84,7 @@ void base16_encode(char *outbuf, char *inbuf, size_t in_length);
 /* unpack.c */
 
 Janet primitive_unpack2(int argc, Janet *argv);
+Janet primitive_unpack2_all(int argc, Janet *argv);
 
 /*  scratchvec.c */
 
@@ -108,11 +124,19 @@ Janet jgetgrnam(int argc, Janet *argv);
 Janet jcleargroups(int argc, Janet *argv);
 Janet jchown(int argc, Janet *argv);
 Janet jexit(int argc, Janet *argv);
+Janet jfork(int argc, Janet *argv);
+Janet jexec(int argc, Janet *argv);
+Janet jwait4(int argc, Janet *argv);
+Janet jcurrent_rss(int argc, Janet *argv);
 Janet jchroot(int argc, Janet *argv);
 Janet unix_listen(int argc, Janet *argv);
 Janet unix_connect(int argc, Janet *argv);
 Janet nuke_path(int argc, Janet *argv);
+Janet jmkdtemp(int argc, Janet *argv);
 Janet jmount(int argc, Janet *argv);
 Janet jsync(int argc, Janet *argv);
+Janet jsyncfs(int argc, Janet *argv);
 Janet jfd_set_cloexec(int argc, Janet *argv);
 Janet jfd_close(int argc, Janet *argv);
+Janet jfd_dup2(int argc, Janet *argv);
+Janet jclose_fds_except(int argc, Janet *argv);
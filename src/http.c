@@ -0,0 +1,494 @@
+#define _POSIX_C_SOURCE 200809L
+#include <janet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "hermes.h"
+
+#ifdef HERMES_WITH_LIBCURL
+#include <curl/curl.h>
+
+/* One handle for the whole process, so libcurl can
+   keep connections alive between downloads from the same host. */
+static CURL *http_handle = NULL;
+static pid_t http_handle_pid = 0;
+
+typedef struct {
+    JanetFunction *on_data;
+    JanetFunction *on_header;
+    JanetBuffer *buf;
+    Janet err;
+    int failed;
+} HttpGet;
+
+static size_t http_write(char *data, size_t size, size_t nmemb, void *p) {
+    HttpGet *g = p;
+    size_t n = size * nmemb;
+    Janet arg, out;
+
+    g->buf->count = 0;
+    janet_buffer_push_bytes(g->buf, (const uint8_t*)data, n);
+    arg = janet_wrap_buffer(g->buf);
+    if (janet_pcall(g->on_data, 1, &arg, &out, NULL) != JANET_SIGNAL_OK) {
+        g->err = out;
+        g->failed = 1;
+        /* Anything but n aborts the transfer. */
+        return 0;
+    }
+    return n;
+}
+
+static size_t http_header(char *data, size_t size, size_t nmemb, void *p) {
+    HttpGet *g = p;
+    size_t n = size * nmemb;
+    Janet arg, out;
+
+    /* Without the line ending, the blank line ending the headers
+       is left out too. */
+    size_t len = n;
+    while (len && (data[len - 1] == '\n' || data[len - 1] == '\r'))
+        len--;
+    if (!len)
+        return n;
+    arg = janet_stringv((const uint8_t*)data, len);
+    if (janet_pcall(g->on_header, 1, &arg, &out, NULL) != JANET_SIGNAL_OK) {
+        g->err = out;
+        g->failed = 1;
+        return 0;
+    }
+    return n;
+}
+
+static CURL *http_get_handle(void) {
+    static int initialized = 0;
+
+    if (http_handle && http_handle_pid != getpid()) {
+        /* Inherited over fork, the connections belong to our parent
+           and cleaning up would shut them down under it. */
+        http_handle = NULL;
+    }
+
+    if (http_handle)
+        return http_handle;
+
+    if (!initialized) {
+        if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+            return NULL;
+        initialized = 1;
+    }
+
+    http_handle = curl_easy_init();
+    if (!http_handle)
+        return NULL;
+    http_handle_pid = getpid();
+
+    /* The same behaviour as curl --fail -L. */
+    curl_easy_setopt(http_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(http_handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(http_handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(http_handle, CURLOPT_WRITEFUNCTION, http_write);
+    return http_handle;
+}
+
+/* (http-get url on-data &opt headers on-header)
+
+   Extra request headers are given as "Name: value" strings,
+   on-header is called with the status line and each response header. */
+Janet http_get(int argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    const char *url = (const char*)janet_getstring(argv, 0);
+    JanetFunction *on_data = janet_getfunction(argv, 1);
+    JanetView headers = {NULL, 0};
+    if (argc > 2 && !janet_checktype(argv[2], JANET_NIL))
+        headers = janet_getindexed(argv, 2);
+    JanetFunction *on_header = NULL;
+    if (argc > 3 && !janet_checktype(argv[3], JANET_NIL))
+        on_header = janet_getfunction(argv, 3);
+
+    CURL *h = http_get_handle();
+    if (!h)
+        janet_panicf("unable to initialize libcurl");
+
+    struct curl_slist *header_list = NULL;
+    for (int32_t i = 0; i < headers.len; i++) {
+        struct curl_slist *l = curl_slist_append(header_list, (const char*)janet_getstring(headers.items, i));
+        if (!l) {
+            curl_slist_free_all(header_list);
+            janet_panicf("out of memory");
+        }
+        header_list = l;
+    }
+
+    char errbuf[CURL_ERROR_SIZE];
+    errbuf[0] = '\0';
+
+    HttpGet g;
+    g.on_data = on_data;
+    g.on_header = on_header;
+    g.buf = janet_buffer(CURL_MAX_WRITE_SIZE);
+    g.err = janet_wrap_nil();
+    g.failed = 0;
+    janet_gcroot(janet_wrap_buffer(g.buf));
+
+    curl_easy_setopt(h, CURLOPT_URL, url);
+    curl_easy_setopt(h, CURLOPT_WRITEDATA, &g);
+    curl_easy_setopt(h, CURLOPT_ERRORBUFFER, errbuf);
+    curl_easy_setopt(h, CURLOPT_HTTPHEADER, header_list);
+    if (on_header) {
+        curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, http_header);
+        curl_easy_setopt(h, CURLOPT_HEADERDATA, &g);
+    }
+    CURLcode rc = curl_easy_perform(h);
+    curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(h, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(h, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(h, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(h, CURLOPT_WRITEDATA, NULL);
+    curl_slist_free_all(header_list);
+
+    janet_gcunroot(janet_wrap_buffer(g.buf));
+
+    if (g.failed)
+        janet_panicv(g.err);
+
+    if (rc == CURLE_UNSUPPORTED_PROTOCOL)
+        return janet_wrap_nil();
+
+    if (rc != CURLE_OK) {
+        Janet fail[2];
+        fail[0] = janet_ckeywordv("fail");
+        fail[1] = janet_wrap_string(
+            janet_formatc("download of %s failed:\n%s\n", url,
+                          errbuf[0] ? errbuf : curl_easy_strerror(rc)));
+        return janet_wrap_tuple(janet_tuple_n(fail, 2));
+    }
+
+    return janet_ckeywordv("ok");
+}
+
+/* Racing mirrors.
+
+   Every mirror is asked for its first byte at once, the first to send
+   it wins and the others are dropped straight away. Answers with a
+   Content-Range also give the size, and tell us big downloads can be
+   fetched in ranges over several connections. */
+
+typedef struct {
+    CURL *h;
+    Janet url;
+    int got_data;
+    double size;
+} HttpProbe;
+
+static size_t http_probe_write(char *data, size_t size, size_t nmemb, void *p) {
+    (void) data;
+    HttpProbe *probe = p;
+    if (size * nmemb != 0)
+        probe->got_data = 1;
+    /* The first byte is all we wanted, abort the transfer. */
+    return 0;
+}
+
+static size_t http_probe_header(char *data, size_t size, size_t nmemb, void *p) {
+    HttpProbe *probe = p;
+    size_t n = size * nmemb;
+    static const char prefix[] = "content-range: bytes 0-0/";
+    size_t plen = sizeof(prefix) - 1;
+
+    if (n > plen && strncasecmp(data, prefix, plen) == 0) {
+        double total = 0;
+        size_t i;
+        for (i = plen; i < n && data[i] >= '0' && data[i] <= '9'; i++)
+            total = total * 10 + (data[i] - '0');
+        if (i > plen)
+            probe->size = total;
+    }
+    return n;
+}
+
+static CURL *http_new_handle(const char *url) {
+    CURL *h = curl_easy_init();
+    if (!h)
+        return NULL;
+    curl_easy_setopt(h, CURLOPT_URL, url);
+    curl_easy_setopt(h, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(h, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+    return h;
+}
+
+static void http_multi_drop(CURLM *m, CURL *h) {
+    curl_multi_remove_handle(m, h);
+    curl_easy_cleanup(h);
+}
+
+/* (http-probe urls timeout)
+
+   Returns {:url url :size size} for the first of urls to send a byte,
+   size is only there if the mirror supports ranges, or [:fail msg]
+   if none does within timeout seconds. */
+Janet http_probe(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    JanetView urls = janet_getindexed(argv, 0);
+    long timeout_ms = (long)(janet_getnumber(argv, 1) * 1000);
+
+    if (!http_get_handle())
+        janet_panicf("unable to initialize libcurl");
+
+    CURLM *m = curl_multi_init();
+    if (!m)
+        janet_panicf("unable to initialize libcurl");
+
+    HttpProbe *probes = janet_smalloc(sizeof(HttpProbe) * (urls.len + 1));
+    int32_t nrunning = 0;
+    for (int32_t i = 0; i < urls.len; i++) {
+        HttpProbe *p = &probes[i];
+        p->url = urls.items[i];
+        p->got_data = 0;
+        p->size = -1;
+        p->h = http_new_handle((const char*)janet_getstring(urls.items, i));
+        if (!p->h)
+            continue;
+        curl_easy_setopt(p->h, CURLOPT_RANGE, "0-0");
+        curl_easy_setopt(p->h, CURLOPT_TIMEOUT_MS, timeout_ms);
+        curl_easy_setopt(p->h, CURLOPT_WRITEFUNCTION, http_probe_write);
+        curl_easy_setopt(p->h, CURLOPT_WRITEDATA, p);
+        curl_easy_setopt(p->h, CURLOPT_HEADERFUNCTION, http_probe_header);
+        curl_easy_setopt(p->h, CURLOPT_HEADERDATA, p);
+        curl_easy_setopt(p->h, CURLOPT_PRIVATE, p);
+        curl_multi_add_handle(m, p->h);
+        nrunning++;
+    }
+
+    HttpProbe *winner = NULL;
+    while (!winner && nrunning) {
+        int still_running, nfds, nmsgs;
+        CURLMsg *msg;
+
+        if (curl_multi_perform(m, &still_running) != CURLM_OK)
+            break;
+        while (!winner && (msg = curl_multi_info_read(m, &nmsgs))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            HttpProbe *p;
+            long code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&p);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            /* Aborted at the first byte, or finished, e.g. an empty file. */
+            int ok = msg->data.result == CURLE_OK ||
+                     (msg->data.result == CURLE_WRITE_ERROR && p->got_data);
+            /* Anything but http has no status code. */
+            if (ok && (code == 0 || code == 200 || code == 206)) {
+                winner = p;
+                if (code != 206)
+                    p->size = -1;
+            }
+            http_multi_drop(m, p->h);
+            p->h = NULL;
+            nrunning--;
+        }
+        if (!winner && nrunning && curl_multi_wait(m, NULL, 0, 1000, &nfds) != CURLM_OK)
+            break;
+    }
+
+    /* Whoever has not answered yet lost. */
+    for (int32_t i = 0; i < urls.len; i++) {
+        if (probes[i].h)
+            http_multi_drop(m, probes[i].h);
+    }
+    curl_multi_cleanup(m);
+
+    Janet result;
+    if (winner) {
+        JanetKV *st = janet_struct_begin(2);
+        janet_struct_put(st, janet_ckeywordv("url"), winner->url);
+        if (winner->size >= 0)
+            janet_struct_put(st, janet_ckeywordv("size"), janet_wrap_number(winner->size));
+        result = janet_wrap_struct(janet_struct_end(st));
+    } else {
+        Janet fail[2];
+        fail[0] = janet_ckeywordv("fail");
+        fail[1] = janet_cstringv("no mirror responded\n");
+        result = janet_wrap_tuple(janet_tuple_n(fail, 2));
+    }
+    janet_sfree(probes);
+    return result;
+}
+
+/* Ranges are fetched in chunks of this size, at most one chunk per
+   connection is in memory, and each is handed on as soon as all
+   chunks before it were. */
+#define HTTP_RANGE_CHUNK (8 * 1024 * 1024)
+
+typedef struct {
+    CURL *h;
+    uint8_t *buf;
+    size_t len;
+    size_t want;
+    int done;
+} HttpRange;
+
+static size_t http_range_write(char *data, size_t size, size_t nmemb, void *p) {
+    HttpRange *r = p;
+    size_t n = size * nmemb;
+    /* More than asked for, the mirror ignored the range. */
+    if (n > r->want - r->len)
+        return 0;
+    memcpy(r->buf + r->len, data, n);
+    r->len += n;
+    return n;
+}
+
+static Janet http_fail(const char *msg, const char *url) {
+    Janet fail[2];
+    fail[0] = janet_ckeywordv("fail");
+    fail[1] = janet_wrap_string(janet_formatc("%s %s\n", msg, url));
+    return janet_wrap_tuple(janet_tuple_n(fail, 2));
+}
+
+/* (http-get-ranges url size connections on-data)
+
+   Like http-get, but the size bytes of url are fetched in ranges over
+   up to connections connections at once, on-data is still called with
+   the data in order. */
+Janet http_get_ranges(int argc, Janet *argv) {
+    janet_fixarity(argc, 4);
+    const char *url = (const char*)janet_getstring(argv, 0);
+    double size = janet_getnumber(argv, 1);
+    int32_t connections = janet_getinteger(argv, 2);
+    JanetFunction *on_data = janet_getfunction(argv, 3);
+
+    if (size < 0 || connections < 1)
+        janet_panicf("expected a size and a positive number of connections");
+    if (!http_get_handle())
+        janet_panicf("unable to initialize libcurl");
+
+    size_t nchunks = (size_t)((size + HTTP_RANGE_CHUNK - 1) / HTTP_RANGE_CHUNK);
+    size_t window = (size_t)connections;
+    CURLM *m = curl_multi_init();
+    if (!m)
+        janet_panicf("unable to initialize libcurl");
+    HttpRange *ranges = janet_smalloc(sizeof(HttpRange) * window);
+    memset(ranges, 0, sizeof(HttpRange) * window);
+    JanetBuffer *buf = janet_buffer(0);
+    janet_gcroot(janet_wrap_buffer(buf));
+
+    Janet result = janet_ckeywordv("ok");
+    Janet err = janet_wrap_nil();
+    int failed = 0;
+    size_t next_start = 0, next_deliver = 0;
+
+    while (next_deliver < nchunks) {
+        /* Chunk i lives in ranges[i % window] until delivered. */
+        while (next_start < nchunks && next_start < next_deliver + window) {
+            HttpRange *r = &ranges[next_start % window];
+            size_t start = next_start * HTTP_RANGE_CHUNK;
+            size_t end = start + HTTP_RANGE_CHUNK < (size_t)size ? start + HTTP_RANGE_CHUNK : (size_t)size;
+            char range[64];
+
+            r->want = end - start;
+            r->len = 0;
+            r->done = 0;
+            if (!r->buf) {
+                r->buf = malloc(HTTP_RANGE_CHUNK);
+                if (!r->buf) {
+                    result = http_fail("out of memory downloading", url);
+                    goto out;
+                }
+            }
+            r->h = http_new_handle(url);
+            if (!r->h) {
+                result = http_fail("unable to start download of", url);
+                goto out;
+            }
+            snprintf(range, sizeof(range), "%zu-%zu", start, end - 1);
+            curl_easy_setopt(r->h, CURLOPT_RANGE, range);
+            curl_easy_setopt(r->h, CURLOPT_WRITEFUNCTION, http_range_write);
+            curl_easy_setopt(r->h, CURLOPT_WRITEDATA, r);
+            curl_easy_setopt(r->h, CURLOPT_PRIVATE, r);
+            curl_multi_add_handle(m, r->h);
+            next_start++;
+        }
+
+        HttpRange *head = &ranges[next_deliver % window];
+        if (head->done) {
+            janet_buffer_setcount(buf, 0);
+            janet_buffer_push_bytes(buf, head->buf, (int32_t)head->len);
+            Janet arg = janet_wrap_buffer(buf), out;
+            if (janet_pcall(on_data, 1, &arg, &out, NULL) != JANET_SIGNAL_OK) {
+                err = out;
+                failed = 1;
+                goto out;
+            }
+            head->done = 0;
+            next_deliver++;
+            continue;
+        }
+
+        int still_running, nfds, nmsgs;
+        CURLMsg *msg;
+        if (curl_multi_perform(m, &still_running) != CURLM_OK) {
+            result = http_fail("ranged download failed for", url);
+            goto out;
+        }
+        while ((msg = curl_multi_info_read(m, &nmsgs))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            HttpRange *r;
+            long code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&r);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            if (msg->data.result != CURLE_OK || code != 206 || r->len != r->want) {
+                result = http_fail("ranged download failed for", url);
+                goto out;
+            }
+            http_multi_drop(m, r->h);
+            r->h = NULL;
+            r->done = 1;
+        }
+        if (!head->done && curl_multi_wait(m, NULL, 0, 1000, &nfds) != CURLM_OK) {
+            result = http_fail("ranged download failed for", url);
+            goto out;
+        }
+    }
+
+out:
+    for (size_t i = 0; i < window; i++) {
+        if (ranges[i].h)
+            http_multi_drop(m, ranges[i].h);
+        free(ranges[i].buf);
+    }
+    curl_multi_cleanup(m);
+    janet_sfree(ranges);
+    janet_gcunroot(janet_wrap_buffer(buf));
+    if (failed)
+        janet_panicv(err);
+    return result;
+}
+
+#else
+
+/* Without libcurl, callers fall back to running curl. */
+Janet http_get(int argc, Janet *argv) {
+    (void) argv;
+    janet_arity(argc, 2, 4);
+    return janet_wrap_nil();
+}
+
+/* Without libcurl, mirrors are tried one at a time. */
+Janet http_probe(int argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 2);
+    return janet_wrap_nil();
+}
+
+Janet http_get_ranges(int argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 4);
+    janet_panicf("ranged downloads need libcurl");
+}
+
+#endif
@@ -1,6 +1,8 @@
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <janet.h>
 #include <alloca.h>
+#include <dirent.h>
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
@@ -13,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/mount.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -194,6 +197,72 @@ Janet jexit(int argc, Janet *argv) {
     exit(janet_getinteger(argv, 0));
 }
 
+Janet jfork(int argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    pid_t pid = fork();
+    if (pid < 0)
+        janet_panicf("unable to fork - %s", strerror(errno));
+    return janet_wrap_number(pid);
+}
+
+Janet jexec(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    JanetView args = janet_getindexed(argv, 0);
+    if (args.len < 1)
+        janet_panicf("expected at least one argument to exec");
+    char **cargs = janet_smalloc(sizeof(char *) * (args.len + 1));
+    for (int32_t i = 0; i < args.len; i++)
+        cargs[i] = (char *)janet_getstring(args.items, i);
+    cargs[args.len] = NULL;
+    execvp(cargs[0], cargs);
+    janet_panicf("unable to exec %s - %s", cargs[0], strerror(errno));
+}
+
+/* Wait for a child, returning its exit code and resource usage. */
+Janet jwait4(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    pid_t pid = janet_getinteger(argv, 0);
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR)
+            janet_panicf("unable to wait for child - %s", strerror(errno));
+    }
+    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    JanetKV *info = janet_struct_begin(4);
+    janet_struct_put(info, janet_ckeywordv("exit-code"), janet_wrap_integer(exit_code));
+    janet_struct_put(info, janet_ckeywordv("user"),
+                     janet_wrap_number(ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6));
+    janet_struct_put(info, janet_ckeywordv("sys"),
+                     janet_wrap_number(ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6));
+    /* Linux reports KiB. */
+    janet_struct_put(info, janet_ckeywordv("max-rss"),
+                     janet_wrap_number((double)ru.ru_maxrss * 1024));
+    return janet_wrap_struct(janet_struct_end(info));
+}
+
+/* Bytes resident in this process now. A forked child starts out
+   sharing them, so they count towards its max-rss as well. */
+Janet jcurrent_rss(int argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    long pages = -1;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*s %ld", &pages) != 1)
+            pages = -1;
+        fclose(f);
+    }
+    if (pages >= 0)
+        return janet_wrap_number((double)pages * sysconf(_SC_PAGESIZE));
+    /* No /proc, our peak is the best guess. */
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return janet_wrap_number(0);
+    return janet_wrap_number((double)ru.ru_maxrss * 1024);
+}
+
 Janet jchroot(int argc, Janet *argv) {
     janet_fixarity(argc, 1);
     if (chroot((const char*)janet_getstring(argv, 0)) != 0)
@@ -389,14 +458,32 @@ finish:
     return janet_wrap_nil();
 }
 
+Janet jmkdtemp(int argc, Janet *argv)
+{
+    janet_fixarity(argc, 1);
+    JanetString template = janet_getstring(argv, 0);
+    int32_t len = janet_string_length(template);
+    char *path = janet_smalloc(len + 1);
+    memcpy(path, template, len);
+    path[len] = 0;
+    if (!mkdtemp(path)) {
+        int err = errno;
+        janet_sfree(path);
+        janet_panicf("unable to create temporary directory - %s", strerror(err));
+    }
+    Janet result = janet_cstringv(path);
+    janet_sfree(path);
+    return result;
+}
+
 Janet jmount(int argc, Janet *argv)
 {
-    janet_fixarity(argc, 4);
+    janet_arity(argc, 4, 5);
     if(mount((const char*)janet_getstring(argv, 0),
              (const char*)janet_getstring(argv, 1),
              (const char*)janet_getstring(argv, 2),
              janet_getnumber(argv, 3),
-             NULL) != 0)
+             argc == 5 ? (const char*)janet_getstring(argv, 4) : NULL) != 0)
         janet_panicf("unable to perform mount - %s", strerror(errno));
     return janet_wrap_nil();
 }
@@ -409,6 +496,21 @@ Janet jsync(int argc, Janet *argv)
     return janet_wrap_nil();
 }
 
+Janet jsyncfs(int argc, Janet *argv)
+{
+    janet_fixarity(argc, 1);
+    const char *path = (const char*)janet_getstring(argv, 0);
+    int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0)
+        janet_panicf("unable to open %s - %s", path, strerror(errno));
+    int rc = syncfs(fd);
+    int err = errno;
+    close(fd);
+    if (rc != 0)
+        janet_panicf("unable to sync filesystem of %s - %s", path, strerror(err));
+    return janet_wrap_nil();
+}
+
 Janet jfd_set_cloexec(int argc, Janet *argv) {
     janet_fixarity(argc, 2);
     int fd = janet_getnumber(argv, 0);
@@ -423,3 +525,73 @@ Janet jfd_close(int argc, Janet *argv) {
       janet_panicf("unable to close fd - %s", strerror(errno));
     return janet_wrap_nil();
 }
+
+/* Old may be an fd number or a file. */
+Janet jfd_dup2(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    int oldfd;
+    if (janet_checktype(argv[0], JANET_NUMBER))
+      oldfd = janet_getnumber(argv, 0);
+    else
+      oldfd = fileno(janet_getfile(argv, 0, NULL));
+    if (dup2(oldfd, janet_getnumber(argv, 1)) < 0)
+      janet_panicf("unable to dup2 fd - %s", strerror(errno));
+    return janet_wrap_nil();
+}
+
+static int fd_kept(int fd, JanetView keep) {
+    for (int32_t i = 0; i < keep.len; i++) {
+        if (janet_checktype(keep.items[i], JANET_NUMBER) && janet_unwrap_number(keep.items[i]) == fd)
+            return 1;
+    }
+    return 0;
+}
+
+/* Close every fd above stderr except those in keep, so a forked
+   child doesn't hold on to the files, locks and pipes of its parent. */
+Janet jclose_fds_except(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    JanetView keep = janet_getindexed(argv, 0);
+
+    DIR *d = opendir("/proc/self/fd");
+    if (d) {
+        int dfd = dirfd(d);
+        int *fds = NULL;
+        size_t nfds = 0, cap = 0;
+        struct dirent *de;
+        while ((de = readdir(d))) {
+            char *end;
+            long fd = strtol(de->d_name, &end, 10);
+            if (*end || end == de->d_name || fd < 3 || fd == dfd)
+                continue;
+            if (nfds == cap) {
+                cap = cap ? cap * 2 : 64;
+                int *n = realloc(fds, cap * sizeof(int));
+                if (!n) {
+                    free(fds);
+                    closedir(d);
+                    janet_panicf("out of memory");
+                }
+                fds = n;
+            }
+            fds[nfds++] = (int)fd;
+        }
+        closedir(d);
+        for (size_t i = 0; i < nfds; i++) {
+            if (!fd_kept(fds[i], keep))
+                close(fds[i]);
+        }
+        free(fds);
+        return janet_wrap_nil();
+    }
+
+    /* No /proc, try every possible fd. */
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0)
+        max = 1024;
+    for (long fd = 3; fd < max; fd++) {
+        if (!fd_kept((int)fd, keep))
+            close((int)fd);
+    }
+    return janet_wrap_nil();
+}
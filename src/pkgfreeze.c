@@ -21,6 +21,7 @@
 */
 
 #include <alloca.h>
+#include <string.h>
 #include <janet.h>
 #include "hermes.h"
 
@@ -49,16 +50,40 @@ static enum {
     LB_FUNCDEF_REF
 } LeadBytes;
 
+static void flush(HashState *st) {
+    sha1_update(&st->sha1_ctx, (char*)st->stage, st->staged);
+    st->staged = 0;
+}
+
+/* Writes are staged and given to sha1 in bulk, it is
+ * far too slow to call it for every byte or integer. */
+static void pushbytes(HashState *st, const uint8_t *bytes, int32_t len) {
+    if (st->staged + len > HASH_STAGE_SZ) {
+        flush(st);
+        if (len > HASH_STAGE_SZ) {
+            sha1_update(&st->sha1_ctx, (char*)bytes, len);
+            return;
+        }
+    }
+    memcpy(st->stage + st->staged, bytes, len);
+    st->staged += len;
+}
+
+static void pushbyte(HashState *st, uint8_t b) {
+    if (st->staged == HASH_STAGE_SZ)
+        flush(st);
+    st->stage[st->staged++] = b;
+}
+
 /* Marshal an integer onto the buffer */
 static void pushint(HashState *st, int32_t x) {
     if (x >= 0 && x < 128) {
-        uint8_t buf[1] = {(uint8_t)x};
-        sha1_update(&st->sha1_ctx, (char*)buf, 1);
+        pushbyte(st, (uint8_t)x);
     } else if (x <= 8191 && x >= -8192) {
         uint8_t intbuf[2];
         intbuf[0] = ((x >> 8) & 0x3F) | 0x80;
         intbuf[1] = x & 0xFF;
-        sha1_update(&st->sha1_ctx, (char*)intbuf, 2);
+        pushbytes(st, intbuf, 2);
     } else {
         uint8_t intbuf[5];
         intbuf[0] = LB_INTEGER;
@@ -66,19 +91,10 @@ static void pushint(HashState *st, int32_t x) {
         intbuf[2] = (x >> 16) & 0xFF;
         intbuf[3] = (x >> 8) & 0xFF;
         intbuf[4] = x & 0xFF;
-        sha1_update(&st->sha1_ctx, (char*)intbuf, 5);
+        pushbytes(st, intbuf, 5);
     }
 }
 
-static void pushbyte(HashState *st, uint8_t b) {
-    uint8_t buf[1] = {b};
-    sha1_update(&st->sha1_ctx, (char*)buf, 1);
-}
-
-static void pushbytes(HashState *st, const uint8_t *bytes, int32_t len) {
-    sha1_update(&st->sha1_ctx, (char*)bytes, len);
-}
-
 /* Forward declaration to enable mutual recursion. */
 static void hash_one(HashState *st, Janet x, int flags);
 static void hash_one_fiber(HashState *st, JanetFiber *fiber, int flags);
@@ -91,14 +107,15 @@ static void hash_one_env(HashState *st, JanetFuncEnv *env, int flags);
 /* Hash a function env */
 static void hash_one_env(HashState *st, JanetFuncEnv *env, int flags) {
     HASH_STACKCHECK;
-    for (int32_t i = 0; i < scratch_v_count(st->seen_envs); i++) {
-        if (st->seen_envs[i] == env) {
-            pushbyte(st, LB_FUNCENV_REF);
-            pushint(st, i);
-            return;
-        }
+    Janet key = janet_wrap_pointer(env);
+    Janet check = janet_table_get(&st->seen_envs, key);
+    if (janet_checkint(check)) {
+        pushbyte(st, LB_FUNCENV_REF);
+        pushint(st, janet_unwrap_integer(check));
+        return;
     }
-    scratch_v_push(st->seen_envs, env);
+    /* Numbered in the order first seen */
+    janet_table_put(&st->seen_envs, key, janet_wrap_integer(st->seen_envs.count));
     if (env->offset) {
         janet_panic("cannot hash closure referencing fiber stack values");
     } else {
@@ -122,16 +139,16 @@ static void janet_func_addflags(JanetFuncDef *def) {
 /* Marshal a function def */
 static void hash_one_def(HashState *st, JanetFuncDef *def, int flags) {
     HASH_STACKCHECK;
-    for (int32_t i = 0; i < scratch_v_count(st->seen_defs); i++) {
-        if (st->seen_defs[i] == def) {
-            pushbyte(st, LB_FUNCDEF_REF);
-            pushint(st, i);
-            return;
-        }
+    Janet key = janet_wrap_pointer(def);
+    Janet check = janet_table_get(&st->seen_defs, key);
+    if (janet_checkint(check)) {
+        pushbyte(st, LB_FUNCDEF_REF);
+        pushint(st, janet_unwrap_integer(check));
+        return;
     }
     janet_func_addflags(def);
-    /* Add to lookup */
-    scratch_v_push(st->seen_defs, def);
+    /* Add to lookup, numbered in the order first seen */
+    janet_table_put(&st->seen_defs, key, janet_wrap_integer(st->seen_defs.count));
     pushint(st, def->flags);
     pushint(st, def->slotcount);
     pushint(st, def->arity);
@@ -150,13 +167,19 @@ static void hash_one_def(HashState *st, JanetFuncDef *def, int flags) {
     for (int32_t i = 0; i < def->constants_length; i++)
         hash_one(st, def->constants[i], flags);
 
-    /* hash the bytecode */
+    /* hash the bytecode, each instruction little endian */
+#ifdef JANET_BIG_ENDIAN
     for (int32_t i = 0; i < def->bytecode_length; i++) {
-        pushbyte(st, def->bytecode[i] & 0xFF);
-        pushbyte(st, (def->bytecode[i] >> 8) & 0xFF);
-        pushbyte(st, (def->bytecode[i] >> 16) & 0xFF);
-        pushbyte(st, (def->bytecode[i] >> 24) & 0xFF);
+        uint8_t insn[4];
+        insn[0] = def->bytecode[i] & 0xFF;
+        insn[1] = (def->bytecode[i] >> 8) & 0xFF;
+        insn[2] = (def->bytecode[i] >> 16) & 0xFF;
+        insn[3] = (def->bytecode[i] >> 24) & 0xFF;
+        pushbytes(st, insn, 4);
     }
+#else
+    pushbytes(st, (const uint8_t *)def->bytecode, def->bytecode_length * 4);
+#endif
 
     /* hash the environments if needed */
     for (int32_t i = 0; i < def->environments_length; i++)
@@ -420,21 +443,23 @@ static void hash_one(HashState *st, Janet x, int flags) {
 
 static void init_pkg_hash_state(HashState *st, JanetTable *rreg) {
     sha1_init(&st->sha1_ctx);
+    st->staged = 0;
     st->nextid = 0;
-    st->seen_defs = NULL;
-    st->seen_envs = NULL;
     st->rreg = rreg;
     janet_table_init(&st->seen, 0);
+    janet_table_init(&st->seen_envs, 0);
+    janet_table_init(&st->seen_defs, 0);
 }
 
 static JanetString finalize_pkg_hash_state(HashState *st) {
     uint8_t buf[HASH_SZ];
     uint8_t hexbuf[HASH_SZ*2];
+    flush(st);
     sha1_final(&st->sha1_ctx, &buf[0]);
     base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
     janet_table_deinit(&st->seen);
-    scratch_v_free(st->seen_envs);
-    scratch_v_free(st->seen_defs);
+    janet_table_deinit(&st->seen_envs);
+    janet_table_deinit(&st->seen_defs);
     return janet_string(hexbuf, sizeof(hexbuf));
 }
 
@@ -46,6 +46,9 @@ Janet storify(int argc, Janet *argv) {
     t.actime = 0;
     t.modtime = 0;
 
+    /* Total size of the regular files, returned for build statistics. */
+    double size = 0;
+
     while(1) {
         fent = fts_read(*pfs);
         if (!fent) {
@@ -59,6 +62,8 @@ Janet storify(int argc, Janet *argv) {
         case FTS_SLNONE:
         case FTS_DEFAULT:
         case FTS_DP:
+            if (fent->fts_info == FTS_F)
+                size += fent->fts_statp->st_size;
             if (lchown(fent->fts_accpath, uid, gid) != 0)
                 janet_panicf("unable to storify %s - lchown - %s", fent->fts_accpath, strerror(errno));
 
@@ -79,6 +84,6 @@ Janet storify(int argc, Janet *argv) {
 
     janet_sfree(pfs);
 
-    return janet_wrap_nil();
+    return janet_wrap_number(size);
 }
 
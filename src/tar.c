@@ -1,31 +1,62 @@
-/* futimes */
+/* strndup */
 #define _GNU_SOURCE
 
 #include "tar.h"
 #include "common.h"
-#include <stdlib.h> /* size_t */
-#include <string.h> /* memcmp, memcpy */
-#include <sys/stat.h> /* mkdir */
-#include <errno.h> /* EEXIST, errno */
-#include <unistd.h> /* ftruncate, symlink */
-#include <fcntl.h> /* O_*, open */
+#include <stdlib.h> /* size_t, malloc, realloc, free */
+#include <string.h> /* memcmp, memcpy, strchr, strdup, strndup */
+#include <sys/stat.h> /* mkdirat, mkfifoat, fchmodat, utimensat */
+#include <errno.h> /* EEXIST, ENOENT, ELOOP, errno */
+#include <unistd.h> /* linkat, symlinkat, unlinkat */
+#include <fcntl.h> /* O_*, AT_SYMLINK_NOFOLLOW */
 #include <assert.h> /* assert */
 #include <sys/time.h> /* struct timeval, futimes */
 #include <limits.h> /* SSIZE_MAX */
+#include <stdint.h> /* SIZE_MAX */
 
 static uint64_t parse_octal(const uint8_t *oct, size_t size) {
 	uint64_t dec = 0;
-    size_t i;
-	for (i = 0; i != size; ++i) {
-        uint64_t c = oct[i];
-        if (c == '\0' || c == ' ') {
-            break;
-        }
+	size_t i = 0;
+
+	/* GNU base-256 encoding, used for values too large for octal. */
+	if (size != 0 && (oct[0] & 0x80U)) {
+		dec = oct[0] & 0x7FU;
+		for (i = 1; i != size; ++i) {
+			dec = dec << 8U | oct[i];
+		}
+		return dec;
+	}
+
+	while (i != size && oct[i] == ' ') {
+		++i;
+	}
+	for (; i != size; ++i) {
+		uint64_t c = oct[i];
+		if (c < '0' || c > '7') {
+			break;
+		}
 		dec = dec << 3U | (c - '0');
 	}
 	return dec;
 }
 
+static int_fast8_t parse_decimal(const char *s, size_t len, uint64_t *out) {
+	uint64_t dec = 0;
+	size_t i;
+
+	if (len == 0) {
+		return -1;
+	}
+	for (i = 0; i != len; ++i) {
+		if (s[i] < '0' || s[i] > '9') {
+			return -1;
+		}
+		dec = dec * 10 + (uint64_t)(s[i] - '0');
+	}
+	*out = dec;
+	return 0;
+}
+
 /* FROM SPECS
  * Header checksum, stored as an octal number in ASCII.  To compute
  * the checksum, set the checksum field to all spaces, then sum all
@@ -50,157 +81,707 @@ static uint_fast32_t calc_chksum(const uint8_t *buf) {
 	return chksum;
 }
 
+static int is_zero(const uint8_t *const buf) {
+	static const uint8_t zeroBlock[TAR_BLOCKSIZE];
+	return !memcmp(buf, zeroBlock, TAR_BLOCKSIZE);
+}
+
+/* Strip leading slashes and refuse names escaping the extraction directory. */
+static const char *safe_name(const char *name) {
+	const char *p;
+
+	while (*name == '/') {
+		++name;
+	}
+	if (*name == '\0') {
+		return ".";
+	}
+
+	for (p = name; p != NULL && *p != '\0';) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+			return NULL;
+		}
+		p = strchr(p, '/');
+		while (p != NULL && *p == '/') {
+			++p;
+		}
+	}
+
+	return name;
+}
+
+/* Create the missing parents of name, for archives without directory entries. */
+static int_fast8_t mkparents(int dirfd, const char *name) {
+	char *path, *p;
+
+	path = strdup(name);
+	if (path == NULL) {
+		return -1;
+	}
+
+	for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdirat(dirfd, path, 0755) < 0 && errno != EEXIST) {
+			free(path);
+			return -1;
+		}
+		*p = '/';
+	}
+
+	free(path);
+	return 0;
+}
+
+/* Open the parent directory of name, one component at a time and never
+ * following a symlink, creating missing parents on the way.
+ * Returns the parent, which is dirfd itself for top level names, and
+ * sets *base to the last component of name.
+ */
+static int open_parent(int dirfd, const char *name, const char **base) {
+	char *path, *comp, *p;
+	int fd = dirfd, next, e;
+
+	path = strdup(name);
+	if (path == NULL) {
+		return -1;
+	}
+
+	for (comp = path; (p = strchr(comp, '/')) != NULL; comp = p + 1) {
+		*p = '\0';
+		if (*comp == '\0' || strcmp(comp, ".") == 0) {
+			continue;
+		}
+		if (mkdirat(fd, comp, 0755) < 0 && errno != EEXIST) {
+			goto fail;
+		}
+		/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
+		next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (next < 0) {
+			goto fail;
+		}
+		if (fd != dirfd) {
+			close(fd);
+		}
+		fd = next;
+	}
+
+	*base = name + (comp - path);
+	free(path);
+	return fd;
+
+fail:
+	e = errno;
+	if (fd != dirfd) {
+		close(fd);
+	}
+	free(path);
+	errno = e;
+	return -1;
+}
+
+static void replace_str(char **dst, char *src) {
+	free(*dst);
+	*dst = src;
+}
+
+static void note_entry(struct tar *ctx, const char *name, int_fast8_t is_dir) {
+	const char *slash;
+
+	if (ctx->seen_entry) {
+		return;
+	}
+	ctx->seen_entry = 1;
+
+	while (name[0] == '.' && name[1] == '/') {
+		name += 2;
+		while (*name == '/') {
+			++name;
+		}
+	}
+
+	slash = strchr(name, '/');
+	if (slash != NULL && slash != name) {
+		ctx->top = strndup(name, (size_t)(slash - name));
+	} else if (is_dir && *name != '\0' && strcmp(name, ".") != 0) {
+		ctx->top = strdup(name);
+	}
+}
+
+static int_fast8_t defer_dir(struct tar *ctx, const char *name, mode_t mode) {
+	struct tar_dir *dir;
+
+	if (ctx->ndirs == ctx->dirs_cap) {
+		size_t cap = ctx->dirs_cap ? ctx->dirs_cap * 2 : 16;
+		struct tar_dir *dirs = realloc(ctx->dirs, cap * sizeof *dirs);
+		if (dirs == NULL) {
+			return -1;
+		}
+		ctx->dirs = dirs;
+		ctx->dirs_cap = cap;
+	}
+
+	dir = &ctx->dirs[ctx->ndirs];
+	dir->name = strdup(name);
+	if (dir->name == NULL) {
+		return -1;
+	}
+	dir->mode = mode;
+	dir->mtime = ctx->ts[1];
+	ctx->ndirs++;
+	return 0;
+}
+
+static int_fast8_t defer_symlink(struct tar *ctx, const char *name, const char *target) {
+	struct tar_link *link;
+
+	if (ctx->nlinks == ctx->links_cap) {
+		size_t cap = ctx->links_cap ? ctx->links_cap * 2 : 16;
+		struct tar_link *links = realloc(ctx->links, cap * sizeof *links);
+		if (links == NULL) {
+			return -1;
+		}
+		ctx->links = links;
+		ctx->links_cap = cap;
+	}
+
+	link = &ctx->links[ctx->nlinks];
+	link->name = strdup(name);
+	link->target = strdup(target);
+	if (link->name == NULL || link->target == NULL) {
+		free(link->name);
+		free(link->target);
+		return -1;
+	}
+	ctx->nlinks++;
+	return 0;
+}
+
+/* A later entry of the same name replaces a deferred symlink. */
+static void drop_symlink(struct tar *ctx, const char *name) {
+	size_t i;
+
+	for (i = 0; i != ctx->nlinks; ++i) {
+		if (strcmp(ctx->links[i].name, name) == 0) {
+			free(ctx->links[i].name);
+			free(ctx->links[i].target);
+			memmove(&ctx->links[i], &ctx->links[i + 1], (ctx->nlinks - i - 1) * sizeof *ctx->links);
+			ctx->nlinks--;
+			return;
+		}
+	}
+}
+
+/* The deferred symlink named name, if any. */
+static const struct tar_link *find_symlink(const struct tar *ctx, const char *name) {
+	size_t i;
+
+	for (i = ctx->nlinks; i != 0; --i) {
+		if (strcmp(ctx->links[i - 1].name, name) == 0) {
+			return &ctx->links[i - 1];
+		}
+	}
+	return NULL;
+}
+
+static int_fast8_t create_symlink(struct tar *ctx, const struct tar_link *link) {
+	int_fast8_t err = 0;
+	const char *base;
+	int fd;
+
+	/* An earlier symlink may sit where a parent of this one should be. */
+	fd = open_parent(ctx->dirfd, link->name, &base);
+	if (fd == -1) {
+		ERR1("Unable to create symlink %s", link->name);
+		return -1;
+	}
+	if (symlinkat(link->target, fd, base) < 0 &&
+	    !(errno == EEXIST && !unlinkat(fd, base, 0) && !symlinkat(link->target, fd, base))) {
+		ERR1("Unable to create symlink %s", link->name);
+		err = -1;
+	}
+	if (fd != ctx->dirfd) {
+		close(fd);
+	}
+	return err;
+}
+
+static int_fast8_t parse_pax(struct tar *ctx) {
+	const char *p = ctx->meta;
+	const char *end = ctx->meta + ctx->meta_len;
+
+	/* Records are "%d %s=%s\n", the length includes itself. */
+	while (p != end) {
+		const char *rec = p, *rec_end, *key, *eq, *val;
+		size_t reclen = 0, keylen, vallen;
+
+		while (p != end && *p >= '0' && *p <= '9') {
+			if (reclen > (SIZE_MAX - 9) / 10) {
+				ERR("Malformed pax header");
+				return -1;
+			}
+			reclen = reclen * 10 + (size_t)(*p++ - '0');
+		}
+		/* At least the length, the space and the newline. */
+		if (p == end || *p != ' ' || reclen < (size_t)(p - rec) + 2 || reclen > (size_t)(end - rec)) {
+			ERR("Malformed pax header");
+			return -1;
+		}
+		rec_end = rec + reclen;
+		key = p + 1;
+		eq = memchr(key, '=', (size_t)(rec_end - key));
+		if (eq == NULL || rec_end[-1] != '\n') {
+			ERR("Malformed pax record");
+			return -1;
+		}
+		keylen = (size_t)(eq - key);
+		val = eq + 1;
+		vallen = (size_t)(rec_end - 1 - val);
+
+#define KEYEQ(k) (keylen == sizeof(k) - 1 && !memcmp(key, k, keylen))
+		if (KEYEQ("path")) {
+			replace_str(&ctx->path, strndup(val, vallen));
+			if (ctx->path == NULL) {
+				return -1;
+			}
+		} else if (KEYEQ("linkpath")) {
+			replace_str(&ctx->link, strndup(val, vallen));
+			if (ctx->link == NULL) {
+				return -1;
+			}
+		} else if (KEYEQ("size")) {
+			if (parse_decimal(val, vallen, &ctx->pax_size)) {
+				ERR("Malformed pax size");
+				return -1;
+			}
+			ctx->has_size = 1;
+		} else if (KEYEQ("mtime")) {
+			const char *dot = memchr(val, '.', vallen);
+			size_t seclen = dot != NULL ? (size_t)(dot - val) : vallen;
+			uint64_t sec = 0, nsec = 0;
+			size_t i;
+
+			/* Times before the epoch are clamped to it. */
+			if (vallen != 0 && val[0] != '-') {
+				if (parse_decimal(val, seclen, &sec)) {
+					ERR("Malformed pax mtime");
+					return -1;
+				}
+				for (i = 0; dot != NULL && i != 9; ++i) {
+					const char *c = dot + 1 + i;
+					nsec *= 10;
+					if (c < val + vallen && *c >= '0' && *c <= '9') {
+						nsec += (uint64_t)(*c - '0');
+					}
+				}
+			}
+			ctx->pax_mtime.tv_sec = (time_t)sec;
+			ctx->pax_mtime.tv_nsec = (long)nsec;
+			ctx->has_mtime = 1;
+		}
+		/* Other keys (atime, uid, uname, comment, ...) are ignored. */
+#undef KEYEQ
+
+		p = rec_end;
+	}
+
+	return 0;
+}
+
+/* Overrides only apply to the header that follows them. */
+static void clear_overrides(struct tar *ctx) {
+	replace_str(&ctx->path, NULL);
+	replace_str(&ctx->link, NULL);
+	ctx->has_size = 0;
+	ctx->has_mtime = 0;
+}
+
+static int_fast8_t create_file(struct tar *ctx, const char *name, mode_t mode) {
+	/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
+	uint32_t flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW;
+
+	if (!fd_createat(&ctx->fd, ctx->dirfd, name, flags, mode)) {
+		return 0;
+	}
+	if (errno == ENOENT && !mkparents(ctx->dirfd, name) &&
+	    !fd_createat(&ctx->fd, ctx->dirfd, name, flags, mode)) {
+		return 0;
+	}
+	/* Never write through a symlink an earlier entry created. */
+	if (errno == ELOOP && !unlinkat(ctx->dirfd, name, 0) &&
+	    !fd_createat(&ctx->fd, ctx->dirfd, name, flags, mode)) {
+		return 0;
+	}
+	ERR1("Unable to create file %s", name);
+	return -1;
+}
+
+static int_fast8_t create_dir(struct tar *ctx, const char *name, mode_t mode) {
+	/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
+	mode_t owner = S_IRWXU;
+
+	if (mkdirat(ctx->dirfd, name, mode | owner) < 0) {
+		if (errno == ENOENT && !mkparents(ctx->dirfd, name) &&
+		    !mkdirat(ctx->dirfd, name, mode | owner)) {
+			/* created */
+		} else if (errno != EEXIST) {
+			ERR1("Unable to create directory %s", name);
+			return -1;
+		}
+	}
+
+	return defer_dir(ctx, name, mode);
+}
+
+#define TAR_MKNOD_RETRY(call, what, name) \
+	do { \
+		if ((call) < 0) { \
+			if (errno == ENOENT && !mkparents(ctx->dirfd, name) && !((call) < 0)) { \
+				break; \
+			} \
+			if (errno == EEXIST && !unlinkat(ctx->dirfd, name, 0) && !((call) < 0)) { \
+				break; \
+			} \
+			ERR1("Unable to create " what " %s", name); \
+			return -1; \
+		} \
+	} while (0)
+
 static int_fast8_t interpret_header(struct tar *ctx,
                           const struct tar_blk *blk) {
 	mode_t mode;
-	uint32_t flags;
-	const char *name;
+	uint64_t size;
+	const char *name, *linkpath;
 	char fullname[TAR_FULLNAME_LEN];
+	char linkname[TAR_TEXT_LEN + 1];
 
 	if (!tar_check((const uint8_t *)blk, TAR_BLOCKSIZE)) {
+		errno = 0;
+		ERR("Invalid tar header");
 		return -1;
 	}
 
-	name = tar_blk_name(blk, fullname);
-	mode = tar_blk_mode(blk);
+	size = ctx->has_size ? ctx->pax_size : tar_blk_size(blk);
+	if (size > SSIZE_MAX) {
+		errno = 0;
+		ERR("Entry too large");
+		return -1;
+	}
+	ctx->size = (size_t)size;
+	ctx->pad = (TAR_BLOCKSIZE - ctx->size % TAR_BLOCKSIZE) % TAR_BLOCKSIZE;
+	ctx->data = TAR_DATA_SKIP;
 
 	switch (blk->type) {
-	case TAR_DIRECTORY:
-		if (mkdir(name, mode) < 0) {
-			if (errno != EEXIST) {
-				ERR1("Unable to create directory %s", name);
+	case TAR_PAX_PERFILE_HEADER:
+	case TAR_GNU_LONGNAME:
+	case TAR_GNU_LONGLINK:
+		/* The size of these records is never overridden. */
+		ctx->size = tar_blk_size(blk);
+		ctx->pad = (TAR_BLOCKSIZE - ctx->size % TAR_BLOCKSIZE) % TAR_BLOCKSIZE;
+		if (ctx->size > TAR_META_MAX) {
+			errno = 0;
+			ERR1("Extended header of %zu bytes is too large", ctx->size);
+			return -1;
+		}
+		if (ctx->meta_cap < ctx->size + 1) {
+			char *meta = realloc(ctx->meta, ctx->size + 1);
+			if (meta == NULL) {
 				return -1;
 			}
+			ctx->meta = meta;
+			ctx->meta_cap = ctx->size + 1;
 		}
-		/* KEEP ctx->size TO ZERO */
-		break;
-	case TAR_PAX_PERFILE_HEADER:
-		name = ".pax_ignore";
+		ctx->meta_len = 0;
+		ctx->data = blk->type == TAR_PAX_PERFILE_HEADER ? TAR_DATA_PAX :
+		            blk->type == TAR_GNU_LONGNAME ? TAR_DATA_LONGNAME :
+		            TAR_DATA_LONGLINK;
+		return 0;
 	case TAR_PAX_GLOBAL_HEADER:
-	case TAR_REGULAR:
-	case TAR_NORMAL:
-		/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
-		flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
-		ctx->ts[1].tv_sec = tar_blk_time(blk);
+	case TAR_GNU_VOLHDR:
+		/* Global records only carry metadata we do not use (e.g. git's comment). */
 		ctx->size = tar_blk_size(blk);
+		ctx->pad = (TAR_BLOCKSIZE - ctx->size % TAR_BLOCKSIZE) % TAR_BLOCKSIZE;
+		return 0;
+	}
 
-		if (fd_create(&ctx->fd, name, flags, mode)) {
-			ERR("fd_create failed");
-			return -1;
-		}
+	name = safe_name(ctx->path != NULL ? ctx->path : tar_blk_name(blk, fullname));
+	if (name == NULL) {
+		errno = 0;
+		ERR1("Refusing to extract %s outside of the destination", ctx->path != NULL ? ctx->path : tar_blk_name(blk, fullname));
+		return -1;
+	}
 
-		if (ctx->size == 0) {
-			fd_time(&ctx->fd, ctx->ts);
-			fd_destroy(&ctx->fd);
-			return 0;
-		}
+	if (ctx->link != NULL) {
+		linkpath = ctx->link;
+	} else {
+		memcpy(linkname, blk->link, sizeof blk->link);
+		linkname[sizeof blk->link] = '\0';
+		linkpath = linkname;
+	}
 
-		if (fd_truncate(&ctx->fd, ctx->size)) {
-			ERR("fd_truncate failed");
+	mode = tar_blk_mode(blk) & 07777U;
+	if (ctx->has_mtime) {
+		ctx->ts[1] = ctx->pax_mtime;
+	} else {
+		ctx->ts[1].tv_sec = tar_blk_time(blk);
+		ctx->ts[1].tv_nsec = 0;
+	}
+
+	note_entry(ctx, name, blk->type == TAR_DIRECTORY);
+	drop_symlink(ctx, name);
+
+	switch (blk->type) {
+	case TAR_DIRECTORY:
+		if (create_dir(ctx, name, mode)) {
 			return -1;
 		}
-
+		break;
+	case TAR_REGULAR:
+	case TAR_NORMAL:
+	case TAR_CONTIGUOUS:
+		if (create_file(ctx, name, mode)) {
+			return -1;
+		}
+		ctx->data = TAR_DATA_FILE;
 		break;
 	case TAR_SYMLINK:
-		if (symlink(blk->link, name) < 0) {
-			ERR1("Unable to create symlink %s", name);
+		/* Created by tar_finish, until then every parent of every entry
+		 * is a real directory, so nothing is written outside of dirfd.
+		 */
+		if (defer_symlink(ctx, name, linkpath)) {
 			return -1;
 		}
-
-		/* KEEP ctx->size TO ZERO */
+		break;
+	case TAR_HARDLINK: {
+		const char *target = safe_name(linkpath);
+		const struct tar_link *symlink;
+		if (target == NULL) {
+			errno = 0;
+			ERR1("Refusing to link to %s outside of the destination", linkpath);
+			return -1;
+		}
+		/* A hardlink to a symlink is the same symlink again. */
+		symlink = find_symlink(ctx, target);
+		if (symlink != NULL) {
+			if (defer_symlink(ctx, name, symlink->target)) {
+				return -1;
+			}
+			break;
+		}
+		TAR_MKNOD_RETRY(linkat(ctx->dirfd, target, ctx->dirfd, name, 0), "hardlink", name);
+		break;
+	}
+	case TAR_FIFO:
+		TAR_MKNOD_RETRY(mkfifoat(ctx->dirfd, name, mode), "fifo", name);
 		break;
 	default:
+		errno = 0;
 		ERR2("Unsupported type %d for %s", blk->type, name);
 		return -1;
 	}
 
+	clear_overrides(ctx);
 	return 0;
 }
 
-static int is_zero(const uint8_t *const buf) {
-	static const uint8_t zeroBlock[TAR_BLOCKSIZE];
-	return !memcmp(buf, zeroBlock, TAR_BLOCKSIZE);
+#undef TAR_MKNOD_RETRY
+
+static int_fast8_t write_data(struct tar *ctx, const uint8_t *buf, size_t len) {
+	switch (ctx->data) {
+	case TAR_DATA_FILE:
+		if (fd_write(&ctx->fd, buf, len) < 0) {
+			ERR("Unable to write file");
+			return -1;
+		}
+		break;
+	case TAR_DATA_PAX:
+	case TAR_DATA_LONGNAME:
+	case TAR_DATA_LONGLINK:
+		/* Capacity was reserved when the header was read. */
+		memcpy(ctx->meta + ctx->meta_len, buf, len);
+		ctx->meta_len += len;
+		break;
+	}
+	return 0;
+}
+
+static int_fast8_t finish_data(struct tar *ctx) {
+	switch (ctx->data) {
+	case TAR_DATA_FILE:
+		fd_time(&ctx->fd, ctx->ts);
+		fd_destroy(&ctx->fd);
+		break;
+	case TAR_DATA_PAX:
+		if (parse_pax(ctx)) {
+			return -1;
+		}
+		break;
+	case TAR_DATA_LONGNAME:
+		ctx->meta[ctx->meta_len] = '\0';
+		replace_str(&ctx->path, strdup(ctx->meta));
+		if (ctx->path == NULL) {
+			return -1;
+		}
+		break;
+	case TAR_DATA_LONGLINK:
+		ctx->meta[ctx->meta_len] = '\0';
+		replace_str(&ctx->link, strdup(ctx->meta));
+		if (ctx->link == NULL) {
+			return -1;
+		}
+		break;
+	}
+	ctx->data = TAR_DATA_SKIP;
+	return 0;
 }
 
 /******************************************************************************/
 
-int_fast8_t tar_create(struct tar *ctx) {
+int_fast8_t tar_create(struct tar *ctx, int dirfd) {
 	time_t atime;
 
 	/* assert(ctx != NULL && ctx->par == 0); */
 
+	ctx->dirfd = dirfd;
+
 	atime = time(NULL);
 	if (atime == ((time_t)-1)) {
 		return -1;
 	}
 
 	ctx->ts[0].tv_sec = atime;
+	ctx->ts[0].tv_nsec = 0;
+
+	return 0;
+}
+
+int_fast8_t tar_finish(struct tar *ctx) {
+	size_t i;
+
+	if (ctx->size != 0 || ctx->nblk != 0) {
+		errno = 0;
+		ERR("Unexpected end of tar archive");
+		return -1;
+	}
+
+	/* Before directory modes, which may make directories read-only. */
+	for (i = 0; i != ctx->nlinks; ++i) {
+		if (create_symlink(ctx, &ctx->links[i])) {
+			return -1;
+		}
+	}
+
+	/* Deepest directories were created last. */
+	for (i = ctx->ndirs; i != 0; --i) {
+		const struct tar_dir *dir = &ctx->dirs[i - 1];
+		const struct timespec ts[2] = {ctx->ts[0], dir->mtime};
+
+		if ((dir->mode & S_IRWXU) != S_IRWXU &&
+		    fchmodat(ctx->dirfd, dir->name, dir->mode, 0) < 0) {
+			ERR1("Unable to chmod directory %s", dir->name);
+			return -1;
+		}
+		/* Like files, times are best effort. */
+		(void)utimensat(ctx->dirfd, dir->name, ts, AT_SYMLINK_NOFOLLOW);
+	}
 
 	return 0;
 }
 
 void tar_destroy(struct tar *ctx) {
-	(void)ctx;
+	size_t i;
+
+	if (ctx->fd.par) {
+		fd_destroy(&ctx->fd);
+	}
+	for (i = 0; i != ctx->ndirs; ++i) {
+		free(ctx->dirs[i].name);
+	}
+	free(ctx->dirs);
+	for (i = 0; i != ctx->nlinks; ++i) {
+		free(ctx->links[i].name);
+		free(ctx->links[i].target);
+	}
+	free(ctx->links);
+	free(ctx->meta);
+	free(ctx->path);
+	free(ctx->link);
+	free(ctx->top);
+	ctx->dirs = NULL;
+	ctx->ndirs = 0;
+	ctx->links = NULL;
+	ctx->nlinks = 0;
+	ctx->meta = NULL;
+	ctx->path = NULL;
+	ctx->link = NULL;
+	ctx->top = NULL;
 }
 
 /*
- * We suppose that the directory has its own header block
- * Also, when extracting all, the order of extraction
- * aloud us to not carry about recursion.
+ * Directories usually have their own header block, missing
+ * parents are created on demand.
+ * Data may arrive in chunks of any size, a header split across
+ * two chunks is buffered in ctx->tar_blk.
  */
 ssize_t tar_write(void *_ctx, const uint8_t *buf, size_t len) {
 	struct tar *ctx = _ctx;
+	ssize_t len2;
 
 	if (len > SSIZE_MAX) {
 		len = SSIZE_MAX;
 	}
+	len2 = (ssize_t)len;
 
-	/* assert(!(len & (BLOCKSIZE - 1))); */
-	assert(len != 0 && len % TAR_BLOCKSIZE == 0);
+	while (len != 0 && !ctx->eof) {
+		size_t n;
 
-	while (len != 0) {
-		if (ctx->size == 0) {
-			if (is_zero(buf)) {
-				break; /* TODO(iemaghni): check two zero blocks */
+		if (ctx->size != 0) {
+			n = ctx->size < len ? ctx->size : len;
+			if (write_data(ctx, buf, n)) {
+				return -1;
 			}
-
-			if (interpret_header(ctx, (struct tar_blk *)buf)) {
+			buf += n;
+			len -= n;
+			ctx->size -= n;
+			if (ctx->size == 0 && finish_data(ctx)) {
 				return -1;
 			}
+		} else if (ctx->pad != 0) {
+			n = ctx->pad < len ? ctx->pad : len;
+			buf += n;
+			len -= n;
+			ctx->pad -= n;
+		} else {
+			uint8_t *blk = (uint8_t *)&ctx->tar_blk;
+
+			n = TAR_BLOCKSIZE - ctx->nblk;
+			if (n > len) {
+				n = len;
+			}
+			memcpy(blk + ctx->nblk, buf, n);
+			buf += n;
+			len -= n;
+			ctx->nblk += n;
+			if (ctx->nblk != TAR_BLOCKSIZE) {
+				break;
+			}
+			ctx->nblk = 0;
 
-			buf += TAR_BLOCKSIZE;
-			len -= TAR_BLOCKSIZE;
-		} else if (ctx->size <= len) {
-			size_t padding, skip;
-			ssize_t wc;
+			if (is_zero(blk)) {
+				ctx->eof = 1; /* end of archive marker */
+				break;
+			}
 
-			wc = fd_write(&ctx->fd, buf, ctx->size);
-			if (wc < 0) {
+			if (interpret_header(ctx, &ctx->tar_blk)) {
 				return -1;
 			}
 
-			fd_time(&ctx->fd, ctx->ts);
-			fd_destroy(&ctx->fd);
-
-			padding = ctx->size % TAR_BLOCKSIZE;
-			skip = ctx->size + (padding != 0 ? TAR_BLOCKSIZE - padding : 0);
-			buf += skip;
-			len -= skip;
-			ctx->size = 0;
-		} else { /* ctx->size > len */
-			ssize_t wc;
-
-			wc = fd_write(&ctx->fd, buf, len);
-			if (wc < 0) {
+			if (ctx->size == 0 && finish_data(ctx)) {
 				return -1;
 			}
-
-			ctx->size -= len;
-			break;
 		}
 	}
 
-	return 0;
+	return len2;
 }
 
 uint_fast8_t tar_check(const uint8_t *buf, size_t len) {
@@ -228,7 +809,8 @@ uint_fast8_t tar_check(const uint8_t *buf, size_t len) {
  */
 const char *tar_blk_name(const struct tar_blk *blk,
                       char fullname[TAR_FULLNAME_LEN]) {
-	if (blk->prefix[0] != '\0') {
+	/* GNU tar uses the prefix bytes for atime/ctime. */
+	if (blk->prefix[0] != '\0' && tar_blk_magic(blk) != 1) {
 		strcpy_vv((str_m_t){TAR_FULLNAME_LEN, fullname}, 3,
 			(str_t[]){
 				{sizeof blk->prefix, blk->prefix},
@@ -273,7 +855,7 @@ time_t tar_blk_time(const struct tar_blk *blk) {
 	return parse_octal(blk->time, sizeof blk->time);
 }
 
-size_t tar_blk_size(const struct tar_blk *blk) {
+uint64_t tar_blk_size(const struct tar_blk *blk) {
 	return parse_octal(blk->size, sizeof blk->size);
 }
 
@@ -19,6 +19,9 @@
 #define TAR_CONTIGUOUS (unsigned int)'7'
 #define TAR_PAX_GLOBAL_HEADER (unsigned int)'g'
 #define TAR_PAX_PERFILE_HEADER (unsigned int)'x'
+#define TAR_GNU_LONGNAME (unsigned int)'L'
+#define TAR_GNU_LONGLINK (unsigned int)'K'
+#define TAR_GNU_VOLHDR (unsigned int)'V'
 
 #define TAR_BLOCKSIZE 512U
 #define TAR_TEXT_LEN 100U
@@ -33,6 +36,9 @@
 #define TAR_MINOR_LEN 8U
 #define TAR_PREFIX_LEN 155U
 
+/* Upper bound for PAX and GNU long name records we buffer in memory. */
+#define TAR_META_MAX (1024U * 1024U)
+
 /* Worst case:
  * text = 100 (no NUL)
  * prefix = 155 (no NUL)
@@ -41,14 +47,14 @@
 #define TAR_FULLNAME_LEN (TAR_PREFIX_LEN + TAR_TEXT_LEN + 2)
 
 /* No Pre-POSIX.1-1988 format
- * Only UStar format (POSIX IEEE P1003.1)
+ * UStar format (POSIX IEEE P1003.1) with PAX and GNU extensions
  */
 struct tar_blk {
 	char    name[TAR_TEXT_LEN];   /* file name */
 	uint8_t mode[TAR_MODE_LEN];   /* permissions */
 	uint8_t uid[TAR_UID_LEN];     /* user id (octal) */
 	uint8_t gid[TAR_GID_LEN];     /* group id (octal) */
-	uint8_t size[TAR_SIZE_LEN];   /* size (octal) */
+	uint8_t size[TAR_SIZE_LEN];   /* size (octal or GNU base-256) */
 	uint8_t time[TAR_TIME_LEN];   /* modification time (octal) */
 	uint8_t csum[TAR_CSUM_LEN];
 	uint8_t type;                    /* file type */
@@ -62,21 +68,86 @@ struct tar_blk {
 	uint8_t pad[12];
 };
 
-#define TAR_INIT(var) var = {0, 0, FD_INIT(.fd), .ts[0].tv_nsec = 0, .ts[1].tv_nsec = 0}
+/* What the data following a header is used for. */
+#define TAR_DATA_SKIP 0U
+#define TAR_DATA_FILE 1U
+#define TAR_DATA_PAX 2U
+#define TAR_DATA_LONGNAME 3U
+#define TAR_DATA_LONGLINK 4U
+
+/* Directory whose mode and mtime are applied once extraction is over,
+ * so read-only directories can still be populated and creating
+ * their entries does not bump the mtime.
+ */
+struct tar_dir {
+	char *name;
+	mode_t mode;
+	struct timespec mtime;
+};
+
+/* Symlink created once extraction is over, so no entry of the archive
+ * can be written through a symlink the archive itself created.
+ */
+struct tar_link {
+	char *name;
+	char *target;
+};
+
+#define TAR_INIT(var) var = {0}
 
 struct tar {
 	uint8_t par;
-	size_t size;
+	int dirfd;           /* entries are created relative to it */
+	uint_fast8_t eof;
+	uint_fast8_t data;   /* TAR_DATA_* */
+	size_t size;         /* data bytes left in the current member */
+	size_t pad;          /* padding bytes left in the current member */
+	size_t nblk;         /* header bytes buffered in tar_blk */
 	struct fd fd;
 	struct timespec ts[2];
 	struct tar_blk tar_blk;
+
+	/* Overrides for the next header from PAX or GNU records. */
+	char *path;
+	char *link;
+	uint_fast8_t has_size;
+	uint64_t pax_size;
+	uint_fast8_t has_mtime;
+	struct timespec pax_mtime;
+
+	/* PAX or GNU record being read. */
+	char *meta;
+	size_t meta_len;
+	size_t meta_cap;
+
+	struct tar_dir *dirs;
+	size_t ndirs;
+	size_t dirs_cap;
+
+	struct tar_link *links;
+	size_t nlinks;
+	size_t links_cap;
+
+	/* Leading directory of the first entry, or NULL. */
+	uint_fast8_t seen_entry;
+	char *top;
 };
 
-int_fast8_t tar_create(struct tar *ctx);
+/* Extract into the directory dirfd, AT_FDCWD for the cwd.
+ * A struct tar has no shared state, several can run in parallel.
+ */
+int_fast8_t tar_create(struct tar *ctx, int dirfd);
+
+/* Fail on truncated archives, create deferred symlinks
+ * and apply deferred directory modes.
+ */
+int_fast8_t tar_finish(struct tar *ctx);
 
 void tar_destroy(struct tar *ctx);
 
-/* implement write interface */
+/* implement write interface
+ * Accepts any chunk size, partial headers are buffered.
+ */
 ssize_t tar_write(void *_ctx, const uint8_t *buf, size_t len);
 
 /* UTILS */
@@ -92,7 +163,7 @@ mode_t tar_blk_mode(const struct tar_blk *blk);
 
 time_t tar_blk_time(const struct tar_blk *blk);
 
-size_t tar_blk_size(const struct tar_blk *blk);
+uint64_t tar_blk_size(const struct tar_blk *blk);
 
 uint_fast32_t tar_blk_csum(const struct tar_blk *blk);
 
@@ -1,109 +1,349 @@
 #include "mm.h"
 #include "tar.h"
 #include "z.h"
+#include "zpar.h"
+#include "common.h"
 #include <assert.h>
+#include <errno.h> /* errno */
+#include <pthread.h> /* pthread_* */
 #include <stdio.h>
-#include <string.h> /* strdup */
+#include <string.h> /* strdup, strerror */
 
 #include <janet.h>
 
-#define CHUNK_LEN 65536UL
+/* Unpack into dirfd, nthreads decoder threads run ahead of extraction,
+ * 0 decodes inline. Keeps no state outside of the call.
+ */
+static int_fast8_t unpack(const uint8_t *data, size_t len, int dirfd,
+                          size_t nthreads, char **dir) {
+    int_fast8_t err = -1;
+    uint_fast8_t fmt;
+    ssize_t rc;
+    const uint8_t *chunk = NULL;
+    uint8_t head[TAR_BLOCKSIZE];
+    size_t nhead = 0;
+    struct zpar zpar;
+    struct tar TAR_INIT(tar);
 
-static int_fast8_t unpack(const uint8_t *data, size_t len, char **dir) {
-    static uint8_t chunk[CHUNK_LEN];
+    fmt = z_check(data, len);
+    if (fmt == Z_FMT_UNKNOWN) {
+        if (!tar_check(data, len)) {
+            ERR("unknown archive format");
+            return -1;
+        }
+        fmt = Z_FMT_NONE;
+    }
 
-    uint_fast8_t type;
+    if (zpar_create(&zpar, fmt, data, len, nthreads)) {
+        return -1;
+    }
 
-    if (z_check(data, len)) {
-        ssize_t rc;
-        struct z z;
+    if (tar_create(&tar, dirfd)) {
+        zpar_destroy(&zpar);
+        return -1;
+    }
 
-        if (z_create(&z, data, len)) {
-            return -1;
-        }
+    /* Decoded chunks can be any size, check a whole first header. */
+    while (nhead != TAR_BLOCKSIZE) {
+        size_t n;
 
-        rc = z_read(&z, chunk, sizeof chunk);
+        rc = zpar_next(&zpar, &chunk);
         if (rc < 0) {
-            return -1;
+            goto out;
         }
+        if (rc == 0) {
+            break;
+        }
+        n = TAR_BLOCKSIZE - nhead < (size_t)rc ? TAR_BLOCKSIZE - nhead : (size_t)rc;
+        memcpy(head + nhead, chunk, n);
+        nhead += n;
+        chunk += n;
+        rc -= (ssize_t)n;
+    }
 
-        if (tar_check(chunk, (size_t)rc)) {
-            struct tar TAR_INIT(tar);
-            struct tar_blk *tar_blk = (struct tar_blk *)chunk;
-
-            if (tar_create(&tar)) {
-                return -1;
-            }
+    if (!tar_check(head, nhead)) {
+        ERR1("%s data is not a tar archive", z_fmt_name(fmt));
+        goto out;
+    }
 
-            if (tar_blk_magic(tar_blk) != 0) {
-                fputs("WARNING: not POSIX ustar\n", stderr);
-            }
+    if (tar_write(&tar, head, nhead) < 0) {
+        goto out;
+    }
+    if (rc == 0) {
+        rc = zpar_next(&zpar, &chunk);
+        if (rc < 0) {
+            goto out;
+        }
+    }
 
-            if (dir != NULL) {
-                if (tar_blk->type == TAR_PAX_GLOBAL_HEADER ||
-                    tar_blk->type == TAR_PAX_PERFILE_HEADER) {
-                    /* skip header and content */
-                    /* suppose that content is <= 512 */
-                    tar_blk += 2;
-                }
-                if (tar_blk->type == TAR_DIRECTORY) {
-                    char fullname[TAR_FULLNAME_LEN];
-                    const char *name = tar_blk_name(tar_blk, fullname);
-                    *dir = strdup(name);
-                }
-            }
+    while (rc > 0) {
+        if (tar_write(&tar, chunk, (size_t)rc) < 0) {
+            goto out;
+        }
+        rc = zpar_next(&zpar, &chunk);
+        if (rc < 0) {
+            goto out;
+        }
+    }
 
-            while (rc > 0) {
-                if (tar_write(&tar, chunk, (size_t)rc) < 0) {
-                    return -1;
-                }
-                rc = z_read(&z, chunk, sizeof chunk);
-                if (rc < 0) {
-                    return -1;
-                }
-            }
+    if (tar_finish(&tar)) {
+        goto out;
+    }
 
-            tar_destroy(&tar);
-        }
-        z_destroy(&z);
+    if (dir != NULL) {
+        *dir = tar.top;
+        tar.top = NULL;
     }
+    err = 0;
 
-    return 0;
+out:
+    tar_destroy(&tar);
+    zpar_destroy(&zpar);
+    return err;
 }
 
-Janet primitive_unpack2(int argc, Janet *argv) {
+static int_fast8_t unpack_file(const char *fname, int dirfd, size_t nthreads,
+                               char **dir) {
     int_fast8_t err;
-    const char *fname;
-    char *dir = NULL;
     struct fd FD_INIT(fd);
     struct mm MM_INIT(mm);
-    JanetString jdir;
-
-    janet_fixarity(argc, 1);
-    fname = janet_getcstring(argv, 0);
 
     /* NOLINTNEXTLINE(hicpp-signed-bitwise) */
     if (fd_create(&fd, fname, O_RDONLY | O_CLOEXEC, 0)) {
-        janet_panic("fd_create failed");
+        ERR1("Unable to open %s", fname);
+        return -1;
     }
 
-	if (mm_create(&mm, &fd)) {
-        janet_panic("mm_create failed");
-	}
+    if (mm_create(&mm, &fd)) {
+        ERR1("Unable to map %s", fname);
+        fd_destroy(&fd);
+        return -1;
+    }
 
-    err = unpack(mm.ptr, mm.len, &dir);
+    err = unpack(mm.ptr, mm.len, dirfd, nthreads, dir);
 
     mm_destroy(&mm);
     fd_destroy(&fd);
+    return err;
+}
+
+static int32_t get_parallelism(int32_t argc, Janet *argv, int32_t n) {
+    int32_t parallelism = janet_optinteger(argv, argc, n, 1);
+    if (parallelism < 0) {
+        janet_panic("parallelism must not be negative");
+    }
+    return parallelism;
+}
+
+/* Buffers are not NUL terminated, so paths are strings only. */
+#define DEST_PATH_TFLAGS (JANET_TFLAG_STRING | JANET_TFLAG_SYMBOL | JANET_TFLAG_KEYWORD)
+
+/* A destination is a directory path, or an open directory fd. */
+static void check_dest(Janet v) {
+    if (!janet_checktypes(v, JANET_TFLAG_NIL | JANET_TFLAG_NUMBER | DEST_PATH_TFLAGS)) {
+        janet_panicf("unpack destination must be a path or directory fd, got %v", v);
+    }
+}
+
+/* Returns the fd to unpack into, only paths are opened (and need a close). */
+static int open_dest(Janet v) {
+    if (janet_checktype(v, JANET_NIL)) {
+        return AT_FDCWD;
+    }
+    if (janet_checktype(v, JANET_NUMBER)) {
+        return janet_unwrap_integer(v);
+    }
+    /* NOLINTNEXTLINE(hicpp-signed-bitwise) */
+    return open((const char *)janet_unwrap_string(v), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static uint_fast8_t owns_dest(Janet v) {
+    return janet_checktypes(v, DEST_PATH_TFLAGS);
+}
+
+static Janet wrap_dir(char *dir) {
+    Janet jdir;
+
+    /* Archives without a leading directory unpack into the destination. */
+    if (dir == NULL) {
+        return janet_wrap_nil();
+    }
+
+    jdir = janet_cstringv(dir);
+    free(dir);
+    return jdir;
+}
+
+Janet primitive_unpack2(int argc, Janet *argv) {
+    int_fast8_t err;
+    const char *fname;
+    int32_t nthreads;
+    int dirfd;
+    Janet dest;
+    char *dir = NULL;
+
+    janet_arity(argc, 1, 3);
+    fname = janet_getcstring(argv, 0);
+    nthreads = get_parallelism(argc, argv, 1);
+    dest = argc > 2 ? argv[2] : janet_wrap_nil();
+    check_dest(dest);
+
+    dirfd = open_dest(dest);
+    if (dirfd < 0 && dirfd != AT_FDCWD) {
+        janet_panicf("unable to open %v - %s", dest, strerror(errno));
+    }
+
+    err = unpack_file(fname, dirfd, (size_t)nthreads, &dir);
+
+    if (owns_dest(dest)) {
+        close(dirfd);
+    }
 
     if (err) {
+        free(dir);
         janet_panic("unpack failed");
     }
 
-    if (dir == NULL) {
-        janet_panic("dir is NULL");
+    return wrap_dir(dir);
+}
+
+struct unpack_job {
+    const char *fname;
+    Janet dest;
+    int dirfd;
+    int_fast8_t err;
+    char *dir;
+};
+
+struct unpack_all {
+    pthread_mutex_t mu;
+    struct unpack_job *jobs;
+    size_t njobs;
+    size_t next;
+    size_t nthreads; /* decoder threads per archive */
+};
+
+static void *unpack_worker(void *_ctx) {
+    struct unpack_all *ctx = _ctx;
+
+    for (;;) {
+        struct unpack_job *job;
+
+        pthread_mutex_lock(&ctx->mu);
+        job = ctx->next != ctx->njobs ? &ctx->jobs[ctx->next++] : NULL;
+        pthread_mutex_unlock(&ctx->mu);
+        if (job == NULL) {
+            return NULL;
+        }
+
+        job->err = unpack_file(job->fname, job->dirfd, ctx->nthreads, &job->dir);
+    }
+}
+
+/* (primitive-unpack2-all archives &opt parallelism)
+ * Every archive is a path, or a [path dest] tuple, they are unpacked
+ * by up to parallelism threads at once.
+ * Returns the leading directory of each archive, like primitive-unpack2.
+ */
+Janet primitive_unpack2_all(int argc, Janet *argv) {
+    JanetView archives;
+    JanetArray *dirs;
+    struct unpack_all ctx;
+    pthread_t threads[64];
+    size_t i, nworkers, nstarted = 0;
+    int32_t parallelism;
+    const char *failed = NULL;
+
+    janet_arity(argc, 1, 2);
+    archives = janet_getindexed(argv, 0);
+    parallelism = get_parallelism(argc, argv, 1);
+
+    memset(&ctx, 0, sizeof ctx);
+    ctx.njobs = (size_t)archives.len;
+    ctx.jobs = janet_smalloc(ctx.njobs * sizeof *ctx.jobs + 1);
+    for (i = 0; i != ctx.njobs; ++i) {
+        struct unpack_job *job = &ctx.jobs[i];
+        Janet v = archives.items[i];
+        const Janet *pair;
+        int32_t pairlen;
+
+        job->dest = janet_wrap_nil();
+        job->dirfd = AT_FDCWD;
+        job->err = 0;
+        job->dir = NULL;
+        if (janet_indexed_view(v, &pair, &pairlen)) {
+            if (pairlen != 2) {
+                janet_panicf("expected an archive or [archive dest], got %v", v);
+            }
+            job->fname = janet_getcstring(pair, 0);
+            job->dest = pair[1];
+            check_dest(job->dest);
+        } else {
+            job->fname = janet_getcstring(&archives.items[i], 0);
+        }
+    }
+
+    for (i = 0; i != ctx.njobs; ++i) {
+        struct unpack_job *job = &ctx.jobs[i];
+        job->dirfd = open_dest(job->dest);
+        if (job->dirfd < 0 && job->dirfd != AT_FDCWD) {
+            int e = errno;
+            while (i-- != 0) {
+                if (owns_dest(ctx.jobs[i].dest)) {
+                    close(ctx.jobs[i].dirfd);
+                }
+            }
+            janet_panicf("unable to open %v - %s", job->dest, strerror(e));
+        }
+    }
+
+    nworkers = parallelism > 0 ? (size_t)parallelism : 1;
+    if (nworkers > ctx.njobs) {
+        nworkers = ctx.njobs;
+    }
+    if (nworkers > sizeof threads / sizeof threads[0]) {
+        nworkers = sizeof threads / sizeof threads[0];
+    }
+    /* Spare threads go to decompression. */
+    ctx.nthreads = nworkers != 0 && (size_t)parallelism > nworkers ?
+                   (size_t)parallelism / nworkers : (size_t)(parallelism != 0);
+
+    pthread_mutex_init(&ctx.mu, NULL);
+    for (i = 0; i != nworkers; ++i) {
+        if (pthread_create(&threads[i], NULL, unpack_worker, &ctx)) {
+            break;
+        }
+        nstarted++;
+    }
+    /* Without threads the archives are unpacked here. */
+    if (nstarted == 0) {
+        unpack_worker(&ctx);
+    }
+    for (i = 0; i != nstarted; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&ctx.mu);
+
+    dirs = janet_array((int32_t)ctx.njobs);
+    for (i = 0; i != ctx.njobs; ++i) {
+        struct unpack_job *job = &ctx.jobs[i];
+        if (owns_dest(job->dest)) {
+            close(job->dirfd);
+        }
+        if (job->err) {
+            free(job->dir);
+            if (failed == NULL) {
+                failed = job->fname;
+            }
+            continue;
+        }
+        janet_array_push(dirs, wrap_dir(job->dir));
+    }
+    janet_sfree(ctx.jobs);
+
+    if (failed != NULL) {
+        janet_panicf("unpack of %s failed", failed);
     }
 
-    jdir = janet_string(dir, strlen(dir));
-    return janet_wrap_string(jdir);
+    return janet_wrap_array(dirs);
 }
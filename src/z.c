@@ -3,70 +3,422 @@
 #include "z.h"
 #include "common.h"
 #include <assert.h> /* assert */
-#include <string.h> /* memcmp */
-#include <stdio.h> /* snprintf */
-#include <limits.h> /* SSIZE_MAX */
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* memcmp, memcpy */
+#include <limits.h> /* SSIZE_MAX, UINT_MAX */
 
-int_fast8_t z_create(struct z *ctx, const uint8_t *buf, size_t len) {
-	int ret;
+/* Hand at most max bytes of the remaining input to the decoder. */
+static size_t z_feed(struct z *ctx, const uint8_t **next, size_t max) {
+	size_t n = ctx->len < max ? ctx->len : max;
+	*next = ctx->buf;
+	ctx->buf += n;
+	ctx->len -= n;
+	return n;
+}
 
-	assert(ctx != NULL);
+static int_fast8_t is_gzip(const uint8_t *buf, size_t len) {
+	/* https://www.ietf.org/rfc/rfc1952.txt
+	 * 2.3.1. Member header and trailer
+	 */
+	return len >= 2 && !memcmp("\037\213", buf, 2);
+}
 
-	if (len > UINT32_MAX) {
-        ERR2("%zu is bigger than %u", len, UINT32_MAX);
-        return -2; /* EOVERFLOW */
-    }
-
-	ctx->z.next_in = buf;
-	ctx->z.avail_in = len;
-	ctx->z.opaque = Z_NULL;
-	ctx->z.zalloc = Z_NULL;
-	ctx->z.zfree = Z_NULL;
-
-	/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
-	ret = inflateInit2(&(ctx->z), MAX_WBITS | 16U);
-	if (ret != Z_OK) {
-		return -1;
+static int_fast8_t is_bzip2(const uint8_t *buf, size_t len) {
+	return len >= 3 && !memcmp("BZh", buf, 3);
+}
+
+/******************************************************************************/
+
+static ssize_t none_read(struct z *ctx, uint8_t *buf, size_t len) {
+	const uint8_t *next;
+	size_t n = z_feed(ctx, &next, len);
+	memcpy(buf, next, n);
+	return (ssize_t)n;
+}
+
+#ifdef HERMES_WITH_LIBDEFLATE
+/* A single member gzip file records its decompressed size in the trailer
+ * (modulo 2^32), which is all libdeflate needs to decode it at once.
+ * Returns 1 when the file has to be streamed instead: several members,
+ * trailing garbage, too big, or corrupt (zlib then reports the error).
+ */
+static int_fast8_t gz_whole(struct z *ctx) {
+	struct libdeflate_decompressor *d;
+	enum libdeflate_result ret;
+	const uint8_t *p;
+	size_t isize, in_len, out_len;
+
+	if (ctx->len < 18) {
+		return 1;
+	}
+
+	p = ctx->buf + ctx->len - 4;
+	isize = (size_t)p[0] | (size_t)p[1] << 8U | (size_t)p[2] << 16U | (size_t)p[3] << 24U;
+	if (isize > Z_WHOLE_MAX) {
+		return 1;
+	}
+
+	ctx->whole = malloc(isize != 0 ? isize : 1);
+	if (ctx->whole == NULL) {
+		return 1;
 	}
 
+	d = libdeflate_alloc_decompressor();
+	if (d == NULL) {
+		free(ctx->whole);
+		ctx->whole = NULL;
+		return 1;
+	}
+	ret = libdeflate_gzip_decompress_ex(d, ctx->buf, ctx->len, ctx->whole, isize,
+	                                    &in_len, &out_len);
+	libdeflate_free_decompressor(d);
+
+	if (ret != LIBDEFLATE_SUCCESS || in_len != ctx->len || out_len != isize) {
+		free(ctx->whole);
+		ctx->whole = NULL;
+		return 1;
+	}
+
+	ctx->whole_len = isize;
+	ctx->whole_off = 0;
+	ctx->eof = 1;
 	return 0;
 }
 
-void z_destroy(struct z *ctx) {
-	inflateEnd(&(ctx->z));
+static ssize_t gz_whole_read(struct z *ctx, uint8_t *buf, size_t len) {
+	size_t n = ctx->whole_len - ctx->whole_off;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buf, ctx->whole + ctx->whole_off, n);
+	ctx->whole_off += n;
+	return (ssize_t)n;
 }
+#endif
+
+static ssize_t gz_read(struct z *ctx, uint8_t *buf, size_t len) {
+	zs_stream *s = &ctx->u.gz;
+	const uint8_t *next;
+
+#ifdef HERMES_WITH_LIBDEFLATE
+	if (ctx->whole != NULL) {
+		return gz_whole_read(ctx, buf, len);
+	}
+#endif
+
+	if (len > UINT32_MAX) {
+		len = UINT32_MAX;
+	}
+
+	s->next_out = buf;
+	s->avail_out = len;
+
+	while (s->avail_out != 0 && !ctx->eof) {
+		int ret;
+
+		if (s->avail_in == 0) {
+			s->avail_in = z_feed(ctx, &next, UINT32_MAX);
+			s->next_in = (void *)next;
+		}
+
+		ret = zs_inflate(s, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			/* A gzip file may be several members concatenated
+			 * together (pigz, bgzip, cat a.gz b.gz), continue
+			 * with the next member if there is one.
+			 * Trailing garbage (e.g. zero padding) is ignored like gzip(1) does.
+			 */
+			if (s->avail_in == 0) {
+				s->avail_in = z_feed(ctx, &next, UINT32_MAX);
+				s->next_in = (void *)next;
+			}
+			if (!is_gzip(s->next_in, s->avail_in)) {
+				ctx->eof = 1;
+				break;
+			}
+			if (zs_inflateReset(s) != Z_OK) {
+				ERR("inflateReset failed");
+				return -1;
+			}
+		} else if (ret != Z_OK) {
+			if (ret == Z_BUF_ERROR && s->avail_in == 0) {
+				ERR("unexpected end of gzip stream");
+			} else {
+				ERR1("Unable to inflate: %s", s->msg ? s->msg : "unknown error");
+			}
+			return -1;
+		}
+	}
 
-void z_err(struct z *ctx, char *buf, size_t len) {
-	snprintf(buf, len, "Unable to inflate: %s\n", ctx->z.msg);
+	return (ssize_t)(len - s->avail_out);
 }
 
+#ifdef HERMES_WITH_XZ
+static ssize_t xz_read(struct z *ctx, uint8_t *buf, size_t len) {
+	lzma_stream *s = &ctx->u.xz;
 
-ssize_t z_read(void *_ctx, uint8_t *buf, size_t len) {
-    struct z *ctx = _ctx;
+	s->next_out = buf;
+	s->avail_out = len;
+
+	while (s->avail_out != 0 && !ctx->eof) {
+		lzma_ret ret;
 
-    if (len > UINT32_MAX) {
-        len = UINT32_MAX;
-    }
+		if (s->avail_in == 0) {
+			s->avail_in = z_feed(ctx, &s->next_in, SIZE_MAX);
+		}
 
-    if (len > SSIZE_MAX) {
-        len = SSIZE_MAX;
-    }
+		/* LZMA_CONCATENATED needs LZMA_FINISH to know the input is over. */
+		ret = lzma_code(s, s->avail_in == 0 ? LZMA_FINISH : LZMA_RUN);
+		if (ret == LZMA_STREAM_END) {
+			ctx->eof = 1;
+		} else if (ret != LZMA_OK) {
+			ERR1("Unable to decompress xz stream: error %d", (int)ret);
+			return -1;
+		}
+	}
+
+	return (ssize_t)(len - s->avail_out);
+}
+#endif
 
-	ctx->z.avail_out = len;
-	ctx->z.next_out = buf;
+#ifdef HERMES_WITH_BZIP2
+static ssize_t bz_read(struct z *ctx, uint8_t *buf, size_t len) {
+	bz_stream *s = &ctx->u.bz;
+	const uint8_t *next;
 
-	switch (inflate(&ctx->z, Z_NO_FLUSH)) {
-    case Z_OK:
-    case Z_STREAM_END:
-		return len - ctx->z.avail_out;
+	if (len > UINT_MAX) {
+		len = UINT_MAX;
+	}
+
+	s->next_out = (char *)buf;
+	s->avail_out = len;
+
+	while (s->avail_out != 0 && !ctx->eof) {
+		int ret;
+
+		if (s->avail_in == 0) {
+			s->avail_in = z_feed(ctx, &next, UINT_MAX);
+			s->next_in = (char *)next;
+		}
+
+		ret = BZ2_bzDecompress(s);
+		if (ret == BZ_STREAM_END) {
+			char *next_out = s->next_out;
+			unsigned int avail_out = s->avail_out;
+			unsigned int avail_in;
+
+			/* Parallel compressors (pbzip2, lbzip2) emit several streams. */
+			if (s->avail_in == 0) {
+				s->avail_in = z_feed(ctx, &next, UINT_MAX);
+				s->next_in = (char *)next;
+			}
+			if (!is_bzip2((const uint8_t *)s->next_in, s->avail_in)) {
+				ctx->eof = 1;
+				break;
+			}
+
+			next = (const uint8_t *)s->next_in;
+			avail_in = s->avail_in;
+			BZ2_bzDecompressEnd(s);
+			if (BZ2_bzDecompressInit(s, 0, 0) != BZ_OK) {
+				ERR("BZ2_bzDecompressInit failed");
+				return -1;
+			}
+			s->next_in = (char *)next;
+			s->avail_in = avail_in;
+			s->next_out = next_out;
+			s->avail_out = avail_out;
+		} else if (ret != BZ_OK) {
+			ERR1("Unable to decompress bzip2 stream: error %d", ret);
+			return -1;
+		} else if (s->avail_in == 0 && ctx->len == 0 && s->avail_out != 0) {
+			ERR("unexpected end of bzip2 stream");
+			return -1;
+		}
+	}
+
+	return (ssize_t)(len - s->avail_out);
+}
+#endif
+
+#ifdef HERMES_WITH_ZSTD
+static ssize_t zstd_read(struct z *ctx, uint8_t *buf, size_t len) {
+	ZSTD_outBuffer out = {buf, len, 0};
+	ZSTD_inBuffer in = {ctx->buf, ctx->len, 0};
+
+	/* Concatenated frames are handled by ZSTD_decompressStream. */
+	while (out.pos != out.size && !ctx->eof) {
+		size_t ret = ZSTD_decompressStream(ctx->u.zstd, &out, &in);
+		if (ZSTD_isError(ret)) {
+			ERR1("Unable to decompress zstd stream: %s", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		/* All input consumed and output flushed. */
+		if (in.pos == in.size && out.pos != out.size) {
+			if (ret != 0) {
+				ERR("unexpected end of zstd stream");
+				return -1;
+			}
+			ctx->eof = 1;
+		}
+	}
+
+	ctx->buf += in.pos;
+	ctx->len -= in.pos;
+
+	return (ssize_t)out.pos;
+}
+#endif
+
+/******************************************************************************/
+
+int_fast8_t z_create(struct z *ctx, uint_fast8_t fmt, const uint8_t *buf, size_t len) {
+	assert(ctx != NULL);
+
+	memset(ctx, 0, sizeof *ctx);
+	ctx->fmt = fmt;
+	ctx->buf = buf;
+	ctx->len = len;
+
+	switch (fmt) {
+	case Z_FMT_NONE:
+		return 0;
+	case Z_FMT_GZIP:
+#ifdef HERMES_WITH_LIBDEFLATE
+		if (gz_whole(ctx) == 0) {
+			return 0;
+		}
+#endif
+		/* zalloc, zfree and opaque are already NULL */
+		/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
+		if (zs_inflateInit2(&ctx->u.gz, MAX_WBITS | 16U) != Z_OK) {
+			return -1;
+		}
+		return 0;
+#ifdef HERMES_WITH_XZ
+	case Z_FMT_XZ: {
+		lzma_stream init = LZMA_STREAM_INIT;
+		ctx->u.xz = init;
+		if (lzma_stream_decoder(&ctx->u.xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+			return -1;
+		}
+		return 0;
+	}
+#endif
+#ifdef HERMES_WITH_BZIP2
+	case Z_FMT_BZIP2:
+		if (BZ2_bzDecompressInit(&ctx->u.bz, 0, 0) != BZ_OK) {
+			return -1;
+		}
+		return 0;
+#endif
+#ifdef HERMES_WITH_ZSTD
+	case Z_FMT_ZSTD:
+		ctx->u.zstd = ZSTD_createDStream();
+		if (ctx->u.zstd == NULL) {
+			return -1;
+		}
+		ZSTD_initDStream(ctx->u.zstd);
+		return 0;
+#endif
+	default:
+		ERR1("%s archives are not supported by this build", z_fmt_name(fmt));
+		return -1;
+	}
+}
+
+void z_destroy(struct z *ctx) {
+	switch (ctx->fmt) {
+	case Z_FMT_GZIP:
+#ifdef HERMES_WITH_LIBDEFLATE
+		if (ctx->whole != NULL) {
+			free(ctx->whole);
+			ctx->whole = NULL;
+			break;
+		}
+#endif
+		zs_inflateEnd(&ctx->u.gz);
+		break;
+#ifdef HERMES_WITH_XZ
+	case Z_FMT_XZ:
+		lzma_end(&ctx->u.xz);
+		break;
+#endif
+#ifdef HERMES_WITH_BZIP2
+	case Z_FMT_BZIP2:
+		BZ2_bzDecompressEnd(&ctx->u.bz);
+		break;
+#endif
+#ifdef HERMES_WITH_ZSTD
+	case Z_FMT_ZSTD:
+		ZSTD_freeDStream(ctx->u.zstd);
+		break;
+#endif
+	}
+}
+
+const char *z_fmt_name(uint_fast8_t fmt) {
+	switch (fmt) {
+	case Z_FMT_NONE:
+		return "uncompressed";
+	case Z_FMT_GZIP:
+		return "gzip";
+	case Z_FMT_XZ:
+		return "xz";
+	case Z_FMT_BZIP2:
+		return "bzip2";
+	case Z_FMT_ZSTD:
+		return "zstd";
+	default:
+		return "unknown";
+	}
+}
+
+ssize_t z_read(void *_ctx, uint8_t *buf, size_t len) {
+	struct z *ctx = _ctx;
+
+	if (len > SSIZE_MAX) {
+		len = SSIZE_MAX;
+	}
+
+	switch (ctx->fmt) {
+	case Z_FMT_NONE:
+		return none_read(ctx, buf, len);
+	case Z_FMT_GZIP:
+		return gz_read(ctx, buf, len);
+#ifdef HERMES_WITH_XZ
+	case Z_FMT_XZ:
+		return xz_read(ctx, buf, len);
+#endif
+#ifdef HERMES_WITH_BZIP2
+	case Z_FMT_BZIP2:
+		return bz_read(ctx, buf, len);
+#endif
+#ifdef HERMES_WITH_ZSTD
+	case Z_FMT_ZSTD:
+		return zstd_read(ctx, buf, len);
+#endif
 	}
 
 	return -1;
 }
 
 uint_fast8_t z_check(const uint8_t *buf, size_t len) {
-	/* https://www.ietf.org/rfc/rfc1952.txt
-     * 2.3.1. Member header and trailer
-	 */
-    return len >= 2 && !memcmp("\037\213", buf, 2);
-}
\ No newline at end of file
+	if (is_gzip(buf, len)) {
+		return Z_FMT_GZIP;
+	}
+
+	if (len >= 6 && !memcmp("\3757zXZ\000", buf, 6)) {
+		return Z_FMT_XZ;
+	}
+
+	if (is_bzip2(buf, len)) {
+		return Z_FMT_BZIP2;
+	}
+
+	if (len >= 4 && !memcmp("\050\265\057\375", buf, 4)) {
+		return Z_FMT_ZSTD;
+	}
+
+	return Z_FMT_UNKNOWN;
+}
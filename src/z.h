@@ -5,25 +5,98 @@
 #include <stdint.h> /* [u]int*_t */
 #include <sys/types.h> /* ssize_t */
 
+/* gzip backend, chosen at build time.
+ * zlib-ng's native API mirrors zlib with a zng_ prefix.
+ */
+#ifdef HERMES_WITH_ZLIB_NG
+#include <zlib-ng.h> /* zng_stream */
+#define zs_stream zng_stream
+#define zs_inflateInit2 zng_inflateInit2
+#define zs_inflate zng_inflate
+#define zs_inflateReset zng_inflateReset
+#define zs_inflateEnd zng_inflateEnd
+#define zs_deflateInit2 zng_deflateInit2
+#define zs_deflate zng_deflate
+#define zs_deflateEnd zng_deflateEnd
+#else
 #include <zlib.h>   /* z_stream */
+#define zs_stream z_stream
+#define zs_inflateInit2 inflateInit2
+#define zs_inflate inflate
+#define zs_inflateReset inflateReset
+#define zs_inflateEnd inflateEnd
+#define zs_deflateInit2 deflateInit2
+#define zs_deflate deflate
+#define zs_deflateEnd deflateEnd
+#endif
+#ifdef HERMES_WITH_LIBDEFLATE
+#include <libdeflate.h> /* libdeflate_gzip_decompress_ex */
+#endif
+#ifdef HERMES_WITH_XZ
+#include <lzma.h>   /* lzma_stream */
+#endif
+#ifdef HERMES_WITH_BZIP2
+#include <bzlib.h>  /* bz_stream */
+#endif
+#ifdef HERMES_WITH_ZSTD
+#include <zstd.h>   /* ZSTD_DStream */
+#endif
 
 #define CHUNK_LEN 65536UL
 
+/* Formats recognised by z_check.
+ * Z_FMT_NONE is never returned by z_check, it is used to
+ * stream data that is not compressed (e.g. a plain tar).
+ */
+#define Z_FMT_UNKNOWN 0U
+#define Z_FMT_NONE 1U
+#define Z_FMT_GZIP 2U
+#define Z_FMT_XZ 3U
+#define Z_FMT_BZIP2 4U
+#define Z_FMT_ZSTD 5U
+
+/* Largest gzip file libdeflate decodes in one go, bigger ones are streamed. */
+#define Z_WHOLE_MAX (256UL * 1024UL * 1024UL)
+
 struct z {
-    const uint8_t *buf;
+	uint_fast8_t fmt;
+	uint_fast8_t eof;
+	/* input not yet handed to the decoder */
+	const uint8_t *buf;
 	size_t len;
-	z_stream z;
+#ifdef HERMES_WITH_LIBDEFLATE
+	/* whole decoded file, NULL when streaming */
+	uint8_t *whole;
+	size_t whole_len;
+	size_t whole_off;
+#endif
+	union {
+		zs_stream gz;
+#ifdef HERMES_WITH_XZ
+		lzma_stream xz;
+#endif
+#ifdef HERMES_WITH_BZIP2
+		bz_stream bz;
+#endif
+#ifdef HERMES_WITH_ZSTD
+		ZSTD_DStream *zstd;
+#endif
+	} u;
 };
 
-int_fast8_t z_create(struct z *ctx, const uint8_t *buf, size_t len);
+int_fast8_t z_create(struct z *ctx, uint_fast8_t fmt, const uint8_t *buf, size_t len);
 
 void z_destroy(struct z *ctx);
 
-void z_err(struct z *ctx, char *buf, size_t len);
+const char *z_fmt_name(uint_fast8_t fmt);
 
-/* implement read interface */
+/* implement read interface
+ * Fills buf completely unless the end of the stream is reached,
+ * returns 0 at the end of the stream and -1 on error.
+ */
 ssize_t z_read(void *_ctx, uint8_t *buf, size_t len);
 
+/* Returns the Z_FMT_* of buf, or Z_FMT_UNKNOWN. */
 uint_fast8_t z_check(const uint8_t *buf, size_t len);
 
-#endif /* Z_H */
\ No newline at end of file
+#endif /* Z_H */
@@ -0,0 +1,372 @@
+#include "zpar.h"
+#include "common.h"
+#include <assert.h> /* assert */
+#include <stdlib.h> /* malloc, realloc, free */
+#include <string.h> /* memset */
+
+static size_t le16(const uint8_t *p) {
+	return (size_t)p[0] | (size_t)p[1] << 8U;
+}
+
+static size_t le32(const uint8_t *p) {
+	return le16(p) | le16(p + 2) << 16U;
+}
+
+/* Size of the BGZF member at buf, or 0 if it is not one.
+ * https://samtools.github.io/hts-specs/SAMv1.pdf 4.1 The BGZF compression format
+ */
+static size_t bgzf_block_size(const uint8_t *buf, size_t len) {
+	const uint8_t *p, *end;
+	size_t xlen;
+
+	/* ID1 ID2 CM FLG(FEXTRA) MTIME(4) XFL OS XLEN(2) */
+	if (len < 18 || buf[0] != 037 || buf[1] != 0213 || buf[2] != 8 || !(buf[3] & 4U)) {
+		return 0;
+	}
+
+	xlen = le16(buf + 10);
+	if (12 + xlen > len) {
+		return 0;
+	}
+
+	for (p = buf + 12, end = p + xlen; p + 4 <= end; p += 4 + le16(p + 2)) {
+		if (p[0] == 'B' && p[1] == 'C' && le16(p + 2) == 2 && p + 6 <= end) {
+			size_t bsize = le16(p + 4) + 1;
+			/* header, at least an empty deflate block, CRC32 and ISIZE */
+			if (bsize < 12 + xlen + 10 || bsize > len) {
+				return 0;
+			}
+			return bsize;
+		}
+	}
+
+	return 0;
+}
+
+static int_fast8_t bgzf_index(struct zpar *ctx) {
+	size_t off = 0, cap = 0, i, out;
+
+	while (off != ctx->len) {
+		size_t bsize = bgzf_block_size(ctx->buf + off, ctx->len - off);
+		if (bsize == 0) {
+			return -1;
+		}
+		if (ctx->nblocks + 1 >= cap) {
+			size_t *blocks;
+			cap = cap ? cap * 2 : 1024;
+			blocks = realloc(ctx->blocks, cap * sizeof *blocks);
+			if (blocks == NULL) {
+				return -1;
+			}
+			ctx->blocks = blocks;
+		}
+		ctx->blocks[ctx->nblocks++] = off;
+		off += bsize;
+	}
+	if (ctx->nblocks == 0) {
+		return -1;
+	}
+	ctx->blocks[ctx->nblocks] = off;
+
+	/* At most one job per member. */
+	ctx->job_blk = malloc((ctx->nblocks + 1) * sizeof *ctx->job_blk);
+	ctx->job_out = malloc(ctx->nblocks * sizeof *ctx->job_out);
+	if (ctx->job_blk == NULL || ctx->job_out == NULL) {
+		return -1;
+	}
+
+	out = 0;
+	ctx->job_blk[0] = 0;
+	for (i = 0; i != ctx->nblocks; ++i) {
+		/* ISIZE, the last 4 bytes of the member */
+		out += le32(ctx->buf + ctx->blocks[i + 1] - 4);
+		if (out >= ZPAR_JOB_LEN || i + 1 == ctx->nblocks) {
+			ctx->job_out[ctx->njobs] = out;
+			ctx->job_blk[++ctx->njobs] = i + 1;
+			out = 0;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef HERMES_WITH_LIBDEFLATE
+typedef struct libdeflate_decompressor *zpar_inflater;
+#else
+typedef zs_stream zpar_inflater;
+#endif
+
+static int_fast8_t bgzf_inflate(struct zpar *ctx, zpar_inflater *s, size_t job,
+                                struct zpar_slot *slot) {
+	size_t i, off = 0, need = ctx->job_out[job] + 1;
+
+	if (slot->cap < need) {
+		uint8_t *buf = realloc(slot->buf, need);
+		if (buf == NULL) {
+			return -1;
+		}
+		slot->buf = buf;
+		slot->cap = need;
+	}
+
+	for (i = ctx->job_blk[job]; i != ctx->job_blk[job + 1]; ++i) {
+		const uint8_t *in = ctx->buf + ctx->blocks[i];
+		size_t in_len = ctx->blocks[i + 1] - ctx->blocks[i];
+		size_t isize = le32(in + in_len - 4);
+#ifdef HERMES_WITH_LIBDEFLATE
+		/* Every member size is known, so decode each in one call. */
+		size_t used, out_len;
+		if (libdeflate_gzip_decompress_ex(*s, in, in_len, slot->buf + off, isize,
+		                                  &used, &out_len) != LIBDEFLATE_SUCCESS ||
+		    used != in_len || out_len != isize) {
+			ERR("Unable to inflate bgzf block");
+			return -1;
+		}
+#else
+		if (zs_inflateReset(s) != Z_OK) {
+			return -1;
+		}
+		s->next_in = (void *)in;
+		s->avail_in = in_len;
+		s->next_out = slot->buf + off;
+		/* one spare byte to catch members longer than ISIZE */
+		s->avail_out = isize + 1;
+		if (zs_inflate(s, Z_FINISH) != Z_STREAM_END || s->avail_in != 0 ||
+		    s->avail_out != 1) {
+			ERR1("Unable to inflate bgzf block: %s", s->msg ? s->msg : "bad block size");
+			return -1;
+		}
+#endif
+		off += isize;
+	}
+
+	slot->len = off;
+	return 0;
+}
+
+static void *worker(void *_ctx) {
+	struct zpar *ctx = _ctx;
+	zpar_inflater s;
+	int_fast8_t failed = 0;
+
+	memset(&s, 0, sizeof s);
+	if (ctx->njobs != 0) {
+#ifdef HERMES_WITH_LIBDEFLATE
+		s = libdeflate_alloc_decompressor();
+		failed = s == NULL;
+#else
+		/* NOLINTNEXTLINE(hicpp-signed-bitwise) */
+		failed = zs_inflateInit2(&s, MAX_WBITS | 16U) != Z_OK;
+#endif
+	}
+	if (failed) {
+		pthread_mutex_lock(&ctx->mu);
+		ctx->err = 1;
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->mu);
+		return NULL;
+	}
+
+	for (;;) {
+		struct zpar_slot *slot;
+		size_t job;
+		uint_fast8_t stop;
+		ssize_t rc = 0;
+
+		pthread_mutex_lock(&ctx->mu);
+		job = ctx->next_job;
+		if (ctx->stop || ctx->err || (ctx->njobs != 0 && job == ctx->njobs)) {
+			pthread_mutex_unlock(&ctx->mu);
+			break;
+		}
+		ctx->next_job++;
+		slot = &ctx->slots[job % ctx->nslots];
+		while (!ctx->stop && slot->owner != job) {
+			pthread_cond_wait(&ctx->cond, &ctx->mu);
+		}
+		stop = ctx->stop;
+		pthread_mutex_unlock(&ctx->mu);
+		if (stop) {
+			break;
+		}
+
+		if (ctx->njobs != 0) {
+			failed = bgzf_inflate(ctx, &s, job, slot);
+		} else {
+			/* Only one thread streams, so jobs arrive in order. */
+			rc = z_read(&ctx->z, slot->buf, slot->cap);
+			slot->len = rc > 0 ? (size_t)rc : 0;
+			failed = rc < 0;
+		}
+
+		pthread_mutex_lock(&ctx->mu);
+		slot->full = 1;
+		ctx->err |= failed;
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->mu);
+
+		if (failed || (ctx->njobs == 0 && rc == 0)) {
+			break;
+		}
+	}
+
+	if (ctx->njobs != 0) {
+#ifdef HERMES_WITH_LIBDEFLATE
+		libdeflate_free_decompressor(s);
+#else
+		zs_inflateEnd(&s);
+#endif
+	}
+	return NULL;
+}
+
+/******************************************************************************/
+
+int_fast8_t zpar_create(struct zpar *ctx, uint_fast8_t fmt,
+                        const uint8_t *buf, size_t len, size_t nthreads) {
+	size_t i;
+
+	assert(ctx != NULL);
+
+	memset(ctx, 0, sizeof *ctx);
+	ctx->buf = buf;
+	ctx->len = len;
+
+	if (pthread_mutex_init(&ctx->mu, NULL)) {
+		return -1;
+	}
+	if (pthread_cond_init(&ctx->cond, NULL)) {
+		pthread_mutex_destroy(&ctx->mu);
+		return -1;
+	}
+
+	if (z_create(&ctx->z, fmt, buf, len)) {
+		pthread_cond_destroy(&ctx->cond);
+		pthread_mutex_destroy(&ctx->mu);
+		return -1;
+	}
+
+	if (nthreads > ZPAR_MAX_THREADS) {
+		nthreads = ZPAR_MAX_THREADS;
+	}
+
+	if (fmt != Z_FMT_GZIP || nthreads < 2 || bgzf_index(ctx)) {
+		/* Not worth or not possible to split, stream it instead. */
+		free(ctx->blocks);
+		free(ctx->job_blk);
+		free(ctx->job_out);
+		ctx->blocks = ctx->job_blk = ctx->job_out = NULL;
+		ctx->nblocks = ctx->njobs = 0;
+		nthreads = nthreads != 0 ? 1 : 0;
+	}
+
+	ctx->nslots = ctx->njobs != 0 ? 2 * nthreads : 4;
+	for (i = 0; i != ctx->nslots; ++i) {
+		ctx->slots[i].owner = i;
+		if (ctx->njobs == 0) {
+			ctx->slots[i].buf = malloc(ZPAR_STREAM_LEN);
+			if (ctx->slots[i].buf == NULL) {
+				zpar_destroy(ctx);
+				return -1;
+			}
+			ctx->slots[i].cap = ZPAR_STREAM_LEN;
+		}
+	}
+
+	for (i = 0; i != nthreads; ++i) {
+		if (pthread_create(&ctx->threads[i], NULL, worker, ctx)) {
+			break;
+		}
+		ctx->nthreads++;
+	}
+
+	if (ctx->nthreads == 0 && ctx->njobs != 0) {
+		/* No threads at all, z copes with BGZF on its own,
+		 * but needs the buffer only streaming slots were given.
+		 */
+		ctx->njobs = 0;
+		if (ctx->slots[0].cap < ZPAR_STREAM_LEN) {
+			uint8_t *buf = realloc(ctx->slots[0].buf, ZPAR_STREAM_LEN);
+			if (buf == NULL) {
+				zpar_destroy(ctx);
+				return -1;
+			}
+			ctx->slots[0].buf = buf;
+			ctx->slots[0].cap = ZPAR_STREAM_LEN;
+		}
+	}
+
+	return 0;
+}
+
+void zpar_destroy(struct zpar *ctx) {
+	size_t i;
+
+	if (ctx->nthreads != 0) {
+		pthread_mutex_lock(&ctx->mu);
+		ctx->stop = 1;
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->mu);
+		for (i = 0; i != ctx->nthreads; ++i) {
+			pthread_join(ctx->threads[i], NULL);
+		}
+		ctx->nthreads = 0;
+	}
+
+	pthread_mutex_destroy(&ctx->mu);
+	pthread_cond_destroy(&ctx->cond);
+
+	for (i = 0; i != ctx->nslots; ++i) {
+		free(ctx->slots[i].buf);
+		ctx->slots[i].buf = NULL;
+	}
+	free(ctx->blocks);
+	free(ctx->job_blk);
+	free(ctx->job_out);
+	ctx->blocks = ctx->job_blk = ctx->job_out = NULL;
+
+	z_destroy(&ctx->z);
+}
+
+ssize_t zpar_next(struct zpar *ctx, const uint8_t **out) {
+	struct zpar_slot *slot;
+	uint_fast8_t err;
+
+	if (ctx->nthreads == 0) {
+		ssize_t rc = z_read(&ctx->z, ctx->slots[0].buf, ctx->slots[0].cap);
+		*out = ctx->slots[0].buf;
+		return rc;
+	}
+
+	pthread_mutex_lock(&ctx->mu);
+	if (ctx->have_cur) {
+		/* Hand the previous slot back to the job that will reuse it. */
+		slot = &ctx->slots[ctx->cur_job % ctx->nslots];
+		slot->full = 0;
+		slot->owner = ctx->cur_job + ctx->nslots;
+		ctx->cur_job++;
+		ctx->have_cur = 0;
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	if (ctx->njobs != 0 && ctx->cur_job == ctx->njobs) {
+		pthread_mutex_unlock(&ctx->mu);
+		return 0;
+	}
+	slot = &ctx->slots[ctx->cur_job % ctx->nslots];
+	while (!slot->full && !ctx->err) {
+		pthread_cond_wait(&ctx->cond, &ctx->mu);
+	}
+	err = ctx->err;
+	pthread_mutex_unlock(&ctx->mu);
+
+	if (err) {
+		return -1;
+	}
+	if (slot->len == 0) {
+		return 0;
+	}
+
+	ctx->have_cur = 1;
+	*out = slot->buf;
+	return (ssize_t)slot->len;
+}
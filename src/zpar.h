@@ -0,0 +1,73 @@
+#ifndef ZPAR_H
+#define ZPAR_H
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* [u]int*_t */
+#include <sys/types.h> /* ssize_t */
+#include <pthread.h> /* pthread_* */
+
+#include "z.h"
+
+#define ZPAR_MAX_THREADS 64U
+#define ZPAR_MAX_SLOTS (2U * ZPAR_MAX_THREADS)
+/* Output chunk of the single stream decoder thread. */
+#define ZPAR_STREAM_LEN (1024UL * 1024UL)
+/* Decompressed size a BGZF job aims for. */
+#define ZPAR_JOB_LEN (4UL * 1024UL * 1024UL)
+
+struct zpar_slot {
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+	size_t owner; /* job allowed to fill this slot */
+	uint_fast8_t full;
+};
+
+/* Decompression off the calling thread.
+ *
+ * BGZF files (bgzip, samtools) record the size of every gzip member,
+ * so groups of members are inflated by several threads at once.
+ * Anything else is decoded by a single thread ahead of the reader,
+ * overlapping decompression with extraction, so an ordinary .tar.gz
+ * gets no multi-core speedup. Decoding one would need speculative
+ * decoding from guessed deflate block boundaries with a deferred
+ * window, as pugz and rapidgzip do, which zlib can not do.
+ * Without threads this is a plain z.
+ */
+struct zpar {
+	struct z z;
+
+	const uint8_t *buf;
+	size_t len;
+
+	/* BGZF index, njobs is 0 when streaming */
+	size_t *blocks;   /* offset of every member, nblocks + 1 entries */
+	size_t nblocks;
+	size_t *job_blk;  /* first member of every job, njobs + 1 entries */
+	size_t *job_out;  /* decompressed size of every job */
+	size_t njobs;
+
+	pthread_mutex_t mu;
+	pthread_cond_t cond;
+	pthread_t threads[ZPAR_MAX_THREADS];
+	size_t nthreads;
+	size_t next_job;
+	size_t cur_job;
+	uint_fast8_t have_cur;
+	uint_fast8_t err;
+	uint_fast8_t stop;
+	size_t nslots;
+	struct zpar_slot slots[ZPAR_MAX_SLOTS];
+};
+
+int_fast8_t zpar_create(struct zpar *ctx, uint_fast8_t fmt,
+                        const uint8_t *buf, size_t len, size_t nthreads);
+
+void zpar_destroy(struct zpar *ctx);
+
+/* Points *out at the next decompressed chunk, valid until the next call.
+ * Returns its length, 0 at the end of the stream or -1 on error.
+ */
+ssize_t zpar_next(struct zpar *ctx, const uint8_t **out);
+
+#endif /* ZPAR_H */